@@ -47,6 +47,7 @@ exit 0
 #include <stdint.h>
 #include <stdalign.h>
 #include <sysexits.h>
+#include <sys/mman.h>
 
 typedef unsigned char      uchar;
 typedef signed char        schar;
@@ -1,4 +1,5 @@
 #include "aux.h"
+#include "sym.h"
 #include "types/arena.h"
 #include "types/value.h"
 #include "types/sexp.h"
@@ -8,62 +9,478 @@
 #include "comp.h"
 #include "read.h"
 
+/* Forms understood so far:
+ *	(+ x ...) (- x ...) (* x ...) (/ x ...)
+ *	(let ((sym x) ...) body)	lexical, inits see the outer scope
+ *	(let* ((sym x) ...) body)	lexical, inits see the earlier ones
+ *	(defvar sym x)			dynamic, always assigns, yields x
+ *	(cons x y) (car x) (cdr x) (list x ...)
+ *	(concat s1 s2)			a new string
+ *	(setcar pair x) (setcdr pair x)	yield x
+ * nil is the empty list. A symbol is lexical if some enclosing let binds it, dynamic otherwise. */
 
-static void compile_(Cell *cell, Chunk *chunk);
+typedef struct {
+	enum {
+		OK,
+		EMPTY_ERR,
+		DOTTED_ERR,
+		CALL_ERR,
+		UNKNOWN_ERR,
+		ARGC_ERR,
+		NUM_ERR,
+		BIND_ERR,
+		ATOM_ERR,
+		DEPTH_ERR,
+	} type;
+	size_t at;
+} CompErr;
 
-#if 0
-static void
-compilerest(Cell *cell, Chunk *chunk)
+const char *COMP_ERR[] = {
+	[OK]          = "COMPILER SAYS OK :)",
+	[EMPTY_ERR]   = "nothing to evaluate in ()",
+	[DOTTED_ERR]  = "arguments are a dotted list",
+	[CALL_ERR]    = "operator is not a symbol",
+	[UNKNOWN_ERR] = "unknown operator",
+	[ARGC_ERR]    = "wrong number of arguments",
+	[NUM_ERR]     = "argument is not a number",
+	[BIND_ERR]    = "binding is not (symbol value)",
+	[ATOM_ERR]    = "atom can't be compiled",
+	[DEPTH_ERR]   = "form needs a deeper stack than the VM has",
+};
+
+static CompErr err;
+static int shared;		/* cells of the form are hash-consed */
+static Arena *arena;		/* of the form, fold copies shared cells there */
+
+const char *
+compileerr(void)
+{
+	return err.type ? COMP_ERR[err.type] : NULL;
+}
+
+size_t
+compileerrat(void)
+{
+	return err.at;
+}
+
+static int
+fail(int type, size_t at)
+{
+	err = (CompErr){type, at};
+	return 0;
+}
+
+/* OP_ADD and the rest for the arithmetic operators, -1 otherwise */
+static int
+arithop(Cell *cell)
 {
-	if (!cell) return;
-	if (ATOMP(CAR(cell))) {
-		/* here emit push instructions for all the literal values */
-		if (CAR(cell)->type == A_INT) {
-			emitcons(TO_INT(CAR(cell)->integer), CELL_LOC(CAR(cell)));
+	if (!ATOMP(cell) || cell->type != A_SYM || cell->sym->len != 1) return -1;
+	switch (cell->sym->name[0]) {
+	case '+': return OP_ADD;
+	case '-': return OP_SUB;
+	case '*': return OP_MUL;
+	case '/': return OP_DIV;
+	default:  return -1;
+	}
+}
+
+#define ARITHP(cell) (CONSP(cell) && arithop(CAR(cell)) >= 0)
+#define NUMCELLP(cell) (ATOMP(cell) && (cell->type == A_INT || cell->type == A_DOUBL))
+
+static Value
+cellnum(Cell *cell)
+{
+	return cell->type == A_INT ? TO_INT(cell->integer) : TO_DOUBL(cell->doubl);
+}
+
+/* number atom `cell' made `val' */
+static Cell *
+numcell(Cell *cell, Value val)
+{
+	if (INTP(val)) {
+		cell->type = A_INT;
+		cell->integer = AS_INT(val);
+	} else {
+		cell->type = A_DOUBL;
+		cell->doubl = AS_DOUBL(val);
+	}
+	return cell;
+}
+
+/* `a op b' the way run() does it, 0 where run() would trap. Ints wrap
+ * instead of overflowing. */
+static int
+arith(int op, Value a, Value b, Value *res)
+{
+	if (DOUBLP(a) || DOUBLP(b)) {
+		double x = AS_NUM(a), y = AS_NUM(b);
+		switch (op) {
+		case OP_ADD: *res = TO_DOUBL(x + y); break;
+		case OP_SUB: *res = TO_DOUBL(x - y); break;
+		case OP_MUL: *res = TO_DOUBL(x * y); break;
+		case OP_DIV: *res = TO_DOUBL(x / y); break;
 		}
-	} else if (CONSP(CAR(cell))) {
-		/* if it's new list this is function call so dispatch it */
-		compile_(CAR(cell), chunk);
+		return 1;
+	}
+	uint32_t x = AS_INT(a), y = AS_INT(b);
+	switch (op) {
+	case OP_ADD: *res = TO_INT((int32_t)(x + y)); break;
+	case OP_SUB: *res = TO_INT((int32_t)(x - y)); break;
+	case OP_MUL: *res = TO_INT((int32_t)(x * y)); break;
+	case OP_DIV:
+		if (!y || (x == (uint32_t)INT32_MIN && y == (uint32_t)-1)) return 0;
+		*res = TO_INT(AS_INT(a) / AS_INT(b));
+		break;
+	}
+	return 1;
+}
+
+/* atom `cell' to be rewritten, a copy of it if it's shared */
+static Cell *
+ownatom(Cell *cell)
+{
+	if (!shared) return cell;
+	Cell *atom = cellof(arena, A_ATOM, CELL_AT(cell));
+	SET_LOC(atom, CELL_LOC(cell));
+	return atom;
+}
+
+/* the conses of form `cell' to be rewritten, copies of them if they're
+ * shared, the arguments themselves stay as they are */
+static Cell *
+ownform(Cell *cell)
+{
+	if (!shared) return cell;
+	Cell *hd = cons(arena, CAR(cell), nil, 0), *tl = hd, *arg;
+	SET_LOC(hd, CELL_LOC(cell));
+	for (arg = CDR(cell); CONSP(arg); arg = CDR(arg)) {
+		Cell *next = cons(arena, CAR(arg), nil, 0);
+		SET_LOC(next, CELL_LOC(arg));
+		SET_CDR(tl, next);
+		tl = next;
+	}
+	SET_CDR(tl, arg);
+	return hd;
+}
+
+/* form `cell' as its value `val', which takes over its first argument,
+ * a number, as conses are too small for atoms */
+static Cell *
+foldto(Cell *cell, Value val)
+{
+	Cell *num = ownatom(CAR(CDR(cell)));
+	SET_LOC(num, CELL_LOC(cell));
+	return numcell(num, val);
+}
+
+/* Rewrites the constant parts of arithmetic form `cell' into number
+ * atoms, in place, or in a copy of the form if its cells are shared.
+ * Arguments are folded first, then the form becomes its value if all of
+ * them are numbers, otherwise a run of numbers at its front becomes
+ * one. Each form is visited once. */
+static Cell *
+fold(Cell *cell)
+{
+	int op = arithop(CAR(cell));
+	size_t n = 0, k = 0;	/* arguments, numbers at the front */
+	Cell *arg;
+	Value acc = TO_INT(0);
+	cell = ownform(cell);
+	for (arg = CDR(cell); CONSP(arg); arg = CDR(arg), n++) {
+		if (ARITHP(CAR(arg))) SET_CAR(arg, fold(CAR(arg)));
+		if (k < n || !NUMCELLP(CAR(arg))) continue;
+		if (n == 0) acc = cellnum(CAR(arg));
+		else if (!arith(op, acc, cellnum(CAR(arg)), &acc)) continue;
+		k = n + 1;
 	}
-	compilerest(CDR(cell), chunk);
+	if (arg || n == 0) return cell;	/* gen reports these */
+	if (n == 1 && k == 1 && (op == OP_SUB || op == OP_DIV)) {
+		if (op == OP_DIV) return arith(op, TO_INT(1), acc, &acc) ? foldto(cell, acc) : cell;
+		if (INTP(acc)) acc = TO_INT((int32_t)-(uint32_t)AS_INT(acc));
+		else acc = TO_DOUBL(-AS_DOUBL(acc));
+		return foldto(cell, acc);
+	}
+	if (k == n) return foldto(cell, acc);
+	if (k >= 2) {
+		Cell *first = CDR(cell), *last = first;
+		for (size_t i = 1; i < k; i++) last = CDR(last);
+		Range loc = CELL_LOC(CAR(first));
+		loc.len = CELL_AT(CAR(last)) + CELL_LEN(CAR(last)) - loc.at;
+		Cell *num = ownatom(CAR(first));
+		SET_LOC(num, loc);
+		SET_CAR(first, numcell(num, acc));
+		SET_CDR(first, CDR(last));
+	}
+	return cell;
 }
 
+static int gen(Comp *comp, Cell *cell, size_t at);
+
+static int
+compile_(Comp *comp, Cell *cell, size_t at)
+{
+	if (ARITHP(cell)) cell = fold(cell);
+	return gen(comp, cell, at);
+}
+
+static size_t
+argc(Cell *cell, Cell **tail)
+{
+	size_t n = 0;
+	for (cell = CDR(cell); CONSP(cell); cell = CDR(cell)) n++;
+	*tail = cell;
+	return n;
+}
+
+static int
+genarith(Comp *comp, Cell *cell, int op)
+{
+	Range pos = CELL_LOC(CAR(cell));
+	Cell *arg;
+	size_t n = argc(cell, &arg), i = 0;
+	if (arg) return fail(DOTTED_ERR, CELL_AT(arg));
+	if (n == 0) {
+		if (op == OP_SUB || op == OP_DIV) return fail(ARGC_ERR, CELL_AT(cell));
+		emit(comp, OP_CONS, pos);
+		emitcons(comp, TO_INT(op == OP_MUL), pos);
+		return 1;
+	}
+	if (n == 1 && op == OP_DIV) {
+		emit(comp, OP_CONS, pos);
+		emitcons(comp, TO_INT(1), pos);
+	}
+	for (arg = CDR(cell); CONSP(arg); arg = CDR(arg), i++) {
+		Cell *x = CAR(arg);
+		if (ATOMP(x) && x->type != A_SYM && !NUMCELLP(x))
+			return fail(NUM_ERR, CELL_AT(x));
+		/* nested arithmetic was folded with this form */
+		if (!(ARITHP(x) ? gen(comp, x, CELL_AT(arg)) : compile_(comp, x, CELL_AT(arg))))
+			return 0;
+		/* (+ x) and (* x) are x, (/ x) divides the 1 pushed above */
+		if (n == 1 && op == OP_SUB) emit(comp, OP_NEG, pos);
+		else if (i > 0 || (n == 1 && op == OP_DIV)) emit(comp, op, pos);
+	}
+	return 1;
+}
+
+/* (let ((sym x) ...) body), `seq' for let* */
+static int
+genlet(Comp *comp, Cell *cell, int seq)
+{
+	Cell *binds, *body, *tail;
+	if (argc(cell, &tail) != 2 || tail) return fail(ARGC_ERR, CELL_AT(cell));
+	binds = CAR(CDR(cell));
+	body = CAR(CDR(CDR(cell)));
+	if (ATOMP(binds)) return fail(BIND_ERR, CELL_AT(binds));
+	envnew(comp);
+	Cell *b;
+	size_t n = 0;
+	for (b = binds; CONSP(b); b = CDR(b), n++) {
+		Cell *bind = CAR(b), *name = CONSP(bind) ? CAR(bind) : nil, *init;
+		if (!CONSP(bind) || argc(bind, &tail) != 1 || tail
+		    || !ATOMP(name) || name->type != A_SYM) {
+			fail(BIND_ERR, bind ? CELL_AT(bind) : CELL_AT(b));
+			goto FAIL;
+		}
+		init = CAR(CDR(bind));
+		if (!compile_(comp, init, CELL_AT(CDR(bind)))) goto FAIL;
+		if (seq) emitbind(comp, name->sym, CELL_LOC(name));
+	}
+	if (b) {
+		fail(DOTTED_ERR, CELL_AT(b));
+		goto FAIL;
+	}
+	/* the inits are on the stack in order, bind them last to first */
+	for (size_t i = n; !seq && i > 0; i--) {
+		b = binds;
+		for (size_t j = 1; j < i; j++) b = CDR(b);
+		emitbind(comp, CAR(CAR(b))->sym, CELL_LOC(CAR(CAR(b))));
+	}
+	if (!compile_(comp, body, CELL_AT(CDR(CDR(cell))))) goto FAIL;
+	envend(comp);
+	return 1;
+FAIL:
+	envend(comp);
+	return 0;
+}
+
+/* primitives taking a fixed number of arguments off the stack */
+static const struct {
+	const char *name;
+	size_t argc;
+	uint8_t op;
+} PRIM[] = {
+	{ "cons",   2, OP_PAIR },
+	{ "car",    1, OP_CAR },
+	{ "cdr",    1, OP_CDR },
+	{ "concat", 2, OP_CONCAT },
+	{ "setcar", 2, OP_SETCAR },
+	{ "setcdr", 2, OP_SETCDR },
+};
+
+/* The operators above by symbol, interned by the first compile() so
+ * gen() compares pointers and not names. */
+static struct {
+	Symbol *nilsym, *let, *letseq, *defvar, *list;
+	Symbol *prim[nelem(PRIM)];
+} kw;
+
 static void
-compile_(Cell *cell, Chunk *chunk)
+kwinit(void)
 {
-	if (!cell) return;
+	if (kw.nilsym) return;
+	kw.nilsym = internz("nil");
+	kw.let = internz("let");
+	kw.letseq = internz("let*");
+	kw.defvar = internz("defvar");
+	kw.list = internz("list");
+	for (size_t i = 0; i < nelem(PRIM); i++) kw.prim[i] = internz(PRIM[i].name);
+}
 
-	if (ATOMP(CAR(cell))) {
-		if (CAR(cell)->type == A_SYM) {
-			if (!strcmp(CAR(cell)->string, "+")) {
-				compilerest(CDR(cell), chunk);
-				emit(OP_ADD, CELL_LOC(CAR(cell)));
-				return;
-			}
+static int
+genargs(Comp *comp, Cell *cell)
+{
+	for (Cell *arg = CDR(cell); CONSP(arg); arg = CDR(arg))
+		if (!compile_(comp, CAR(arg), CELL_AT(arg))) return 0;
+	return 1;
+}
+
+static int
+genprim(Comp *comp, Cell *cell, size_t prim)
+{
+	Cell *tail;
+	if (argc(cell, &tail) != PRIM[prim].argc || tail) return fail(ARGC_ERR, CELL_AT(cell));
+	if (!genargs(comp, cell)) return 0;
+	emit(comp, PRIM[prim].op, CELL_LOC(CAR(cell)));
+	return 1;
+}
+
+static void
+emitslot(Comp *comp, uint8_t op, size_t slot, Range pos)
+{
+	emit(comp, op, pos);
+	emitarg(comp, slot, pos);
+}
+
+/* (list x ...) is (cons x (cons ... nil)). Each x is consed onto the
+ * last pair as soon as it's evaluated, the first and the last pair are
+ * kept in slots of their own, so the stack doesn't grow with the list. */
+static int
+genlist(Comp *comp, Cell *cell)
+{
+	Range pos = CELL_LOC(CAR(cell));
+	Cell *tail, *arg;
+	size_t head, last;
+	argc(cell, &tail);
+	if (tail) return fail(DOTTED_ERR, CELL_AT(tail));
+	if (!CDR(cell)) {
+		emit(comp, OP_CONS, pos);
+		emitcons(comp, (Value){ .as_uint = NULL_VALUE }, pos);
+		return 1;
+	}
+	envnew(comp);
+	head = maketemp(comp);
+	last = maketemp(comp);
+	for (arg = CDR(cell); CONSP(arg); arg = CDR(arg)) {
+		if (arg != CDR(cell)) emitslot(comp, OP_LOAD_LEX, last, pos);
+		if (!compile_(comp, CAR(arg), CELL_AT(arg))) {
+			envend(comp);
+			return 0;
 		}
-	} else {
-		/* this is unreachable case right now */
-		assert(0 && "unreachable");
+		emit(comp, OP_CONS, pos);
+		emitcons(comp, (Value){ .as_uint = NULL_VALUE }, pos);
+		emit(comp, OP_PAIR, pos);
+		if (arg == CDR(cell)) emitslot(comp, OP_TEE_LEX, head, pos);
+		else emit(comp, OP_SETCDR, pos);	/* leaves the new pair */
+		emitslot(comp, OP_BIND_LEX, last, pos);
 	}
+	emitslot(comp, OP_LOAD_LEX, head, pos);
+	envend(comp);
+	return 1;
+}
 
+static int
+gendefvar(Comp *comp, Cell *cell)
+{
+	Cell *name, *tail;
+	if (argc(cell, &tail) != 2 || tail) return fail(ARGC_ERR, CELL_AT(cell));
+	name = CAR(CDR(cell));
+	if (!ATOMP(name) || name->type != A_SYM) return fail(BIND_ERR, CELL_AT(CDR(cell)));
+	if (!compile_(comp, CAR(CDR(CDR(cell))), CELL_AT(CDR(CDR(cell))))) return 0;
+	emitbind_dyn(comp, name->sym, CELL_LOC(name));
+	emitload_dyn(comp, name->sym, CELL_LOC(name));
+	return 1;
+}
+
+/* code leaving the value of `cell' on the stack, `at' is where a nil
+ * `cell' was */
+static int
+gen(Comp *comp, Cell *cell, size_t at)
+{
+	if (!cell) return fail(EMPTY_ERR, at);
+	if (ATOMP(cell)) {
+		Range pos = CELL_LOC(cell);
+		switch (cell->type) {
+		case A_INT:
+		case A_DOUBL:
+			emit(comp, OP_CONS, pos);
+			emitcons(comp, cellnum(cell), pos);
+			return 1;
+		case A_STR:
+			emit(comp, OP_CONS, pos);
+			emitarg(comp, poolstr(comp->chunk->pool, cell->string, cell->slen), pos);
+			return 1;
+		case A_SYM:
+			if (emitload(comp, cell->sym, pos) != SIZE_MAX) return 1;
+			if (cell->sym == kw.nilsym) {
+				emit(comp, OP_CONS, pos);
+				emitcons(comp, (Value){ .as_uint = NULL_VALUE }, pos);
+			} else {
+				emitload_dyn(comp, cell->sym, pos);
+			}
+			return 1;
+		default:
+			return fail(ATOM_ERR, CELL_AT(cell));
+		}
+	}
+	Cell *op = CAR(cell);
+	int arith;
+	if (!op) return fail(EMPTY_ERR, CELL_AT(cell));
+	if (!ATOMP(op) || op->type != A_SYM) return fail(CALL_ERR, CELL_AT(op));
+	if ((arith = arithop(op)) >= 0) return genarith(comp, cell, arith);
+	if (op->sym == kw.let)    return genlet(comp, cell, 0);
+	if (op->sym == kw.letseq) return genlet(comp, cell, 1);
+	if (op->sym == kw.defvar) return gendefvar(comp, cell);
+	if (op->sym == kw.list)   return genlist(comp, cell);
+	for (size_t i = 0; i < nelem(PRIM); i++)
+		if (op->sym == kw.prim[i]) return genprim(comp, cell, i);
+	return fail(UNKNOWN_ERR, CELL_AT(op));
 }
-#endif
 
 Chunk *
-compile(Sexp *sexp)
+compile(Sexp *sexp, Pool *pool)
 {
 	Cell *cell = sexp->cell;
-	Chunk *chunk = chunknew();
+	Chunk *chunk = chunknew(pool);
 	Comp *comp = compnew(chunk);
-	/* compile_(cell, chunk); */
-	emit(comp, OP_CONS, (Range){0, 0});
-	emitcons(comp, TO_INT(3), (Range){0, 0});
-	/*
-	ht_set(comp->env->lexbind, "val",3);
-	printf(";;; VALUE: %d\n", ht_find_idx(comp->env->lexbind, "val"));
-	*/
-	emitbind(comp, "val", (Range){0, 0});
-	emitload(comp, "val", (Range){0, 0});
-	emit(comp, OP_RET, (Range){0, 0});
+	kwinit();
+	err = (CompErr){OK, 0};
+	shared = sexp->locs != nil;
+	arena = sexp->arena;
+	if (!compile_(comp, cell, 0)) {
+		envend(comp);
+		compfree(comp);
+		chunkfree(chunk);
+		return nil;
+	}
+	emit(comp, OP_RET, CELL_LOC(cell));
+	envend(comp);
+	compfree(comp);
+	if (chunk->nlocals > STACK_MAX || chunk->maxstack > STACK_MAX - chunk->nlocals) {
+		fail(DEPTH_ERR, cell ? CELL_AT(cell) : 0);
+		chunkfree(chunk);
+		return nil;
+	}
 	return chunk;
 }
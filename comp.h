@@ -5,7 +5,11 @@
 #include "types/ht.h"
 */
 
-Chunk *compile(Sexp *sexp);
+/* constants go to `pool' if not nil, see chunknew */
+Chunk *compile(Sexp *sexp, Pool *pool);
+/* why the last compile returned nil and where in the input */
+const char *compileerr(void);
+size_t compileerrat(void);
 Range whereis(Chunk *chunk, ptrdiff_t offset);
 void chunkfree(Chunk *chunk);
-Chunk *chunknew(void);
+Chunk *chunknew(Pool *pool);
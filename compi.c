@@ -1,33 +1,125 @@
 #include "aux.h"
+#include "sym.h"
 #include "types/value.h"
 #include "types/arena.h"
 #include "types/sexp.h"
 #include "types/vec.h"
 #include "types/ht.h"
 #include "compi.h"
+#include "jit.h"
+
+#define POOL_INI_CAP 16		/* have to be power of 2 */
 
 struct SerialRange {
 	Range range;
 	size_t count;		/* count of repetitive ranges */
 };
 
+static uint64_t
+poolhash(Value val)
+{
+	if (STRP(val)) return hash_key(AS_PTR(val));
+	return hash_keyn((const char *)&val.as_uint, sizeof(val.as_uint));
+}
+
+static int
+pooleq(Value a, Value b)
+{
+	if (STRP(a) && STRP(b)) return !strcmp(AS_PTR(a), AS_PTR(b));
+	return a.as_uint == b.as_uint;
+}
+
+static void
+poolgrow(Pool *pool)
+{
+	free(pool->tab);
+	pool->cap = pool->cap ? pool->cap << 1 : POOL_INI_CAP;
+	pool->tab = calloc(pool->cap, sizeof(uint32_t));
+	for (size_t i = 0; i < vec_len(pool->vals); i++) {
+		size_t idx = poolhash(pool->vals[i]) & (pool->cap - 1);
+		while (pool->tab[idx]) idx = (idx + 1) & (pool->cap - 1);
+		pool->tab[idx] = i + 1;
+	}
+}
+
+Pool *
+poolnew(void)
+{
+	Pool *pool = malloc(sizeof(Pool));
+	vec_ini(pool->vals);
+	pool->tab = nil;
+	pool->cap = 0;
+	pool->refs = 1;
+	pool->lookups = 0;
+	pool->hits = 0;
+	poolgrow(pool);
+	return pool;
+}
+
+void
+poolfree(Pool *pool)
+{
+	if (!pool || --pool->refs > 0) return;
+	for (size_t i = 0; i < vec_len(pool->vals); i++)
+		if (STRP(pool->vals[i])) free(AS_PTR(pool->vals[i]));
+	vec_free(pool->vals);
+	free(pool->tab);
+	free(pool);
+}
+
+size_t
+poolput(Pool *pool, Value val)
+{
+	size_t idx = poolhash(val) & (pool->cap - 1);
+	pool->lookups++;
+	for (uint32_t i; (i = pool->tab[idx]); idx = (idx + 1) & (pool->cap - 1)) {
+		if (pooleq(pool->vals[i - 1], val)) {
+			pool->hits++;
+			return i - 1;
+		}
+	}
+	vec_push(pool->vals, val);
+	pool->tab[idx] = vec_len(pool->vals);
+	if (vec_len(pool->vals) * 2 > pool->cap) poolgrow(pool);
+	return vec_len(pool->vals) - 1;
+}
+
+size_t
+poolstr(Pool *pool, const char *str, size_t len)
+{
+	char *copy = strndup(str, len);
+	Value val = TO_STR(copy);
+	size_t idx = poolput(pool, val);
+	if (pool->vals[idx].as_uint != val.as_uint) free(copy);
+	return idx;
+}
+
 
 void
 chunkfree(Chunk *chunk)
 {
 	vec_free(chunk->code);
 	vec_free(chunk->where);
-	vec_free(chunk->conspool);
+	poolfree(chunk->pool);
+	jitfree(chunk->jit);
+	free(chunk->quick);
 	free(chunk);
 }
 
 Chunk *
-chunknew(void)
+chunknew(Pool *pool)
 {
 	Chunk *chunk = malloc(sizeof(Chunk));
+	if (pool) pool->refs++;
+	else pool = poolnew();
+	chunk->pool = pool;
+	chunk->nlocals = 0;
+	chunk->maxstack = 0;
+	chunk->runs = 0;
+	chunk->jit = nil;
+	chunk->quick = nil;
 	vec_ini(chunk->code);
 	vec_ini(chunk->where);
-	vec_ini(chunk->conspool);
 	return chunk;
 }
 
@@ -37,6 +129,7 @@ compnew(Chunk *chunk)
 	Comp *comp = malloc(sizeof(Comp));
 	comp->env = nil;
 	comp->lexcount = 0;
+	comp->depth = 0;
 	comp->chunk = chunk;
 	envnew(comp);
 	return comp;
@@ -48,16 +141,91 @@ compfree(Comp *comp)
 	free(comp);
 }
 
-void
-emit(Comp *comp, uint8_t byte, Range pos)
+static void
+put(Chunk *chunk, uint8_t byte, Range pos)
 {
-	vec_push(comp->chunk->code, byte);
-	if (vec_len(comp->chunk->where) > 0 && vec_end(comp->chunk->where).range.at == pos.at) {
-		vec_end(comp->chunk->where).count++;
+	vec_push(chunk->code, byte);
+	if (vec_len(chunk->where) > 0 && vec_end(chunk->where).range.at == pos.at) {
+		vec_end(chunk->where).count++;
 	} else {
 		SerialRange range = {.range = pos, .count = 1};
-		vec_push(comp->chunk->where, range);
+		vec_push(chunk->where, range);
+	}
+}
+
+static void
+putarg(Chunk *chunk, size_t arg, Range pos)
+{
+	for (; arg >= 0x80; arg >>= 7)
+		put(chunk, (arg & 0x7f) | 0x80, pos);
+	put(chunk, arg, pos);
+}
+
+/* how an op the compiler emits changes the stack depth */
+static int
+opeffect(uint8_t op)
+{
+	switch (op) {
+	case OP_CONS: case OP_LOAD_LEX: case OP_LOAD_DYN:
+		return 1;
+	case OP_TEE_LEX: case OP_NEG: case OP_CAR: case OP_CDR:
+		return 0;
+	default:	/* binds, binary ops and RET */
+		return -1;
+	}
+}
+
+void
+chunkput(Chunk *chunk, uint8_t byte, Range pos)
+{
+	put(chunk, byte, pos);
+}
+
+void
+emit(Comp *comp, uint8_t byte, Range pos)
+{
+	int effect = opeffect(byte);
+	put(comp->chunk, byte, pos);
+	assert(effect >= 0 || comp->depth > 0);	/* pops what it pushed */
+	comp->depth += effect;
+	comp->chunk->maxstack = max(comp->chunk->maxstack, comp->depth);
+}
+
+void
+emitarg(Comp *comp, size_t arg, Range pos)
+{
+	putarg(comp->chunk, arg, pos);
+}
+
+const uint8_t OPARG[] = {
+#define X(name, arg) [OP_##name] = arg,
+	OPS(X)
+#undef X
+};
+
+const uint8_t SUPER[][SUPER_MAX] = {
+#define X(name, a, b, c) { OP_##a, OP_##b, OP_##c },
+	SUPERS(X)
+#undef X
+};
+
+int
+ophasarg(uint8_t op)
+{
+	return op < OP_SUPER_BASE && OPARG[op] != OPARG_NONE;
+}
+
+size_t
+opnext(Chunk *chunk, size_t offset)
+{
+	uint8_t parts[SUPER_MAX];
+	size_t len, next = offset + 1;
+	for (int i = 0, n = superparts(chunk->code[offset], parts); i < n; i++) {
+		if (!ophasarg(parts[i])) continue;
+		uleb(chunk->code + next, &len);
+		next += len;
 	}
+	return next;
 }
 
 Range
@@ -70,18 +238,122 @@ whereis(Chunk *chunk, ptrdiff_t offset)
 	return chunk->where[i].range;
 }
 
+typedef struct {
+	uint8_t op;
+	int hasarg;
+	int live;		/* LOAD_LEX whose slot is read again after it */
+	size_t arg;
+	Range pos;
+} Ins;
+
+/*	BIND_LEX n, LOAD_LEX n	-> TEE_LEX n, nothing if n isn't read again
+ *	CONS k, NEG		-> CONS -k for a number k
+ *	NEG, NEG		-> nothing, a non-number no longer fails there
+ * Instructions are checked against what's been output so far, so a
+ * rewrite can enable the next one. What replaces a pair keeps the
+ * range of its first instruction. The code has no jumps, so a slot is
+ * read again if a LOAD_LEX of it comes before the next bind.
+ * At level 2 the longest SUPERS row matching at each instruction
+ * replaces it, the operands of its parts follow in order. */
+ptrdiff_t
+peephole(Chunk *chunk, int level)
+{
+	size_t size = vec_len(chunk->code), w = 0, seen = 0, nslots = 0, len;
+	Vec(Ins) in;
+	Vec(Ins) out;
+	uint8_t *live;
+	vec_ini(in);
+	vec_ini(out);
+	for (size_t off = 0; off < size;) {
+		uint8_t parts[SUPER_MAX];
+		int n = superparts(chunk->code[off], parts);
+		while (seen + chunk->where[w].count <= off) seen += chunk->where[w++].count;
+		off++;
+		/* superinstructions come apart and may fuse again below */
+		for (int i = 0; i < n; i++) {
+			Ins ins = { .op = parts[i], .pos = chunk->where[w].range };
+			if ((ins.hasarg = ophasarg(ins.op))) {
+				ins.arg = uleb(chunk->code + off, &len);
+				off += len;
+			}
+			if (ins.op == OP_LOAD_LEX || ins.op == OP_BIND_LEX || ins.op == OP_TEE_LEX)
+				nslots = max(nslots, ins.arg + 1);
+			vec_push(in, ins);
+		}
+	}
+	live = calloc(max(nslots, 1), 1);
+	for (size_t i = vec_len(in); i-- > 0;) {
+		switch (in[i].op) {
+		case OP_LOAD_LEX:
+			in[i].live = live[in[i].arg];
+			live[in[i].arg] = 1;
+			break;
+		case OP_BIND_LEX:
+		case OP_TEE_LEX:
+			live[in[i].arg] = 0;
+			break;
+		}
+	}
+	free(live);
+	for (size_t i = 0; i < vec_len(in); i++) {
+		Ins *last = vec_len(out) ? &vec_end(out) : nil;
+		Value k;
+		switch (in[i].op) {
+		case OP_LOAD_LEX:
+			if (!last || last->op != OP_BIND_LEX || last->arg != in[i].arg) break;
+			if (in[i].live) last->op = OP_TEE_LEX;
+			else (void)vec_pop(out);
+			continue;
+		case OP_NEG:
+			if (last && last->op == OP_NEG) {
+				(void)vec_pop(out);
+				continue;
+			}
+			if (!last || last->op != OP_CONS) break;
+			k = chunk->pool->vals[last->arg];
+			if (INTP(k)) k = TO_INT((int32_t)-(uint32_t)AS_INT(k));
+			else if (DOUBLP(k)) k = TO_DOUBL(-AS_DOUBL(k));
+			else break;
+			last->arg = poolput(chunk->pool, k);
+			continue;
+		}
+		vec_push(out, in[i]);
+	}
+	vecptr(chunk->code)->len = 0;
+	vecptr(chunk->where)->len = 0;
+	for (size_t i = 0; i < vec_len(out);) {
+		size_t n = 1, super = 0;
+		for (size_t s = 0; level >= 2 && s < OP_COUNT - OP_SUPER_BASE; s++) {
+			size_t m = 0;
+			while (m < SUPER_MAX && SUPER[s][m] != OP_NONE && i + m < vec_len(out)
+			       && out[i + m].op == SUPER[s][m])
+				m++;
+			if (m > n && (m == SUPER_MAX || SUPER[s][m] == OP_NONE)) {
+				n = m;
+				super = OP_SUPER_BASE + s;
+			}
+		}
+		put(chunk, n > 1 ? super : out[i].op, out[i].pos);
+		for (size_t j = i; j < i + n; j++)
+			if (out[j].hasarg) putarg(chunk, out[j].arg, out[i].pos);
+		i += n;
+	}
+	vec_free(in);
+	vec_free(out);
+	return (ptrdiff_t)size - (ptrdiff_t)vec_len(chunk->code);
+}
+
 void
 emitcons(Comp *comp, Value val, Range pos)
 {
-	vec_push(comp->chunk->conspool, val);
-	emit(comp, vec_len(comp->chunk->conspool) - 1, pos);
+	emitarg(comp, poolput(comp->chunk->pool, val), pos);
 }
 
 static size_t
-findbind(Comp *comp, const char *name)
+findbind(Comp *comp, Symbol *name)
 {
         for (Env *env = comp->env; env; env = env->top) {
-		size_t idx = ht_find_idx(env->lexbind, name);
+		size_t idx = ht_find_idx_h(env->lexbind, name->name, name->hash);
 		if (!ht_idxp(env->lexbind, idx)) continue;
 		return env->lexbind[idx];
 	}
@@ -89,11 +361,20 @@ findbind(Comp *comp, const char *name)
 }
 
 static size_t
-makebind(Comp *comp, const char *name)
+makebind(Comp *comp, Symbol *name)
 {
-	size_t idx = ht_find_idx(comp->env->lexbind, name);
+	size_t idx = ht_find_idx_h(comp->env->lexbind, name->name, name->hash);
 	if (ht_idxp(comp->env->lexbind, idx)) return comp->env->lexbind[idx];
-	ht_set(comp->env->lexbind, name, comp->lexcount++);
+	ht_set_h(comp->env->lexbind, name->name, name->hash, comp->lexcount++);
+	comp->chunk->nlocals = max(comp->chunk->nlocals, comp->lexcount);
+	return comp->lexcount - 1;
+}
+
+size_t
+maketemp(Comp *comp)
+{
+	comp->lexcount++;
+	comp->chunk->nlocals = max(comp->chunk->nlocals, comp->lexcount);
 	return comp->lexcount - 1;
 }
 
@@ -102,6 +383,7 @@ envnew(Comp *comp)
 {
 	Env *new = malloc(sizeof(Env));
 	ht_ini(new->lexbind);
+	ht_borrow(new->lexbind);	/* keys are interned symbol names */
 	new->stackp = comp->lexcount;
 	new->top = comp->env;
 	comp->env = new;
@@ -118,34 +400,34 @@ envend(Comp *comp)
 }
 
 size_t
-emitload(Comp *comp, const char *name, Range pos)
+emitload(Comp *comp, Symbol *name, Range pos)
 {
 	size_t bind;
 	if ((bind = findbind(comp, name)) == SIZE_MAX) return -1;
 	emit(comp, OP_LOAD_LEX, pos);
-	emitcons(comp, TO_INT(bind), pos);
+	emitarg(comp, bind, pos);
 	return bind;
 }
 
 size_t
-emitbind(Comp *comp, const char *name, Range pos)
+emitbind(Comp *comp, Symbol *name, Range pos)
 {
 	size_t bind = makebind(comp, name);
 	emit(comp, OP_BIND_LEX, pos);
-	emitcons(comp, TO_INT(bind), pos);
+	emitarg(comp, bind, pos);
 	return bind;
 }
 
 void
-emitbind_dyn(Comp *comp, const char *name, Range pos)
+emitbind_dyn(Comp *comp, Symbol *name, Range pos)
 {
 	emit(comp, OP_BIND_DYN, pos);
-	emitcons(comp, TO_STR(name), pos);
+	emitcons(comp, TO_SYM(name), pos);
 }
 
 void
-emitload_dyn(Comp *comp, const char *name, Range pos)
+emitload_dyn(Comp *comp, Symbol *name, Range pos)
 {
 	emit(comp, OP_LOAD_DYN, pos);
-	emitcons(comp, TO_STR(name), pos);
+	emitcons(comp, TO_SYM(name), pos);
 }
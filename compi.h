@@ -1,59 +1,205 @@
 /* compiler interface */
 
+#define STACK_MAX 4096		/* VM stack slots, locals and operands */
+
 typedef struct SerialRange SerialRange;
 typedef struct Env Env;
+typedef struct Jit Jit;
+
+/* per arithmetic site counts of the quickened op, see eval.c */
+typedef struct {
+	uint32_t hits;		/* guard held, only with -DQUICK_STATS */
+	uint32_t misses;	/* guard failed and the site went generic */
+} Quick;
+
+/* Constants of one chunk, or of a whole module when the chunks share
+ * it. Each distinct value gets one index, strings count as equal by
+ * their contents and are copies the pool owns, see poolstr. */
+typedef struct {
+	Vec(Value) vals;
+	uint32_t *tab;		/* open addressing, index + 1 into vals, 0 free */
+	size_t cap;
+	size_t refs;		/* chunks using it */
+	size_t lookups;		/* poolput calls */
+	size_t hits;		/* ... that found the value already there */
+} Pool;
 
 typedef struct {
 	const char *fname;
 	Vec(uint8_t) code;
-	Vec(Value) conspool;
+	Pool *pool;		/* the conspool, indexed by CONS and DYN operands */
 	Vec(SerialRange) where;	/* run length encoding */
+	size_t nlocals;		/* lexical slots the frame needs */
+	size_t maxstack;	/* operands on top of them at most */
+	size_t runs;		/* times run, for JIT promotion */
+	Jit *jit;		/* native code, see jit.h */
+	Quick *quick;		/* one per code byte, made on the first run */
 } Chunk;
 
 typedef struct {
 	Env *env;
 	size_t lexcount;
+	size_t depth;		/* operands on the stack after the code so far */
 	Chunk *chunk;
 } Comp;
 
 struct Env {
-	Ht(size_t) lexbind;	/* each bind reference slot on the stack */
+	Ht(size_t) lexbind;	/* each bind reference slot on the stack, by symbol name */
 	size_t stackp;		/* pointer to the stack slot the env starts at */
 	struct Env *top;
 };
 
 
+/* What follows an opcode in the code: nothing, a lexical slot or the
+ * index of a constant in the pool. */
+enum { OPARG_NONE, OPARG_SLOT, OPARG_K };
+
+/* The opcodes with their operand, in the order of their numbers. The
+ * enum, ophasarg and the decomp printers are generated from this table,
+ * the superinstructions of SUPERS follow it. */
+#define OPS(X)								\
+	X(RET, OPARG_NONE)						\
+	X(BIND_LEX, OPARG_SLOT)						\
+	X(BIND_DYN, OPARG_K)						\
+	X(LOAD_DYN, OPARG_K)						\
+	X(LOAD_LEX, OPARG_SLOT)						\
+	X(CONS, OPARG_K)						\
+	X(NEG, OPARG_NONE)						\
+	X(ADD, OPARG_NONE)						\
+	X(SUB, OPARG_NONE)						\
+	X(MUL, OPARG_NONE)						\
+	X(DIV, OPARG_NONE)						\
+	/* Quickened arithmetic, run() rewrites a generic op into one of \
+	 * these once it saw the operand types: II both int, DD both	\
+	 * double, ID one of each in either order. */			\
+	X(ADD_II, OPARG_NONE) X(ADD_DD, OPARG_NONE) X(ADD_ID, OPARG_NONE) \
+	X(SUB_II, OPARG_NONE) X(SUB_DD, OPARG_NONE) X(SUB_ID, OPARG_NONE) \
+	X(MUL_II, OPARG_NONE) X(MUL_DD, OPARG_NONE) X(MUL_ID, OPARG_NONE) \
+	X(DIV_II, OPARG_NONE) X(DIV_DD, OPARG_NONE) X(DIV_ID, OPARG_NONE) \
+	/* BIND_LEX that leaves the value on the stack, see peephole */	\
+	X(TEE_LEX, OPARG_SLOT)						\
+	/* heap objects, see heap.h */					\
+	X(PAIR, OPARG_NONE)	/* car cdr -- pair */			\
+	X(CAR, OPARG_NONE)						\
+	X(CDR, OPARG_NONE)						\
+	X(CONCAT, OPARG_NONE)	/* string string -- string */		\
+	X(SETCAR, OPARG_NONE)	/* pair val -- val */			\
+	X(SETCDR, OPARG_NONE)
+
+/* Superinstructions: a run of two or three ops under one dispatch,
+ * with the operands of its parts one after the other. Rows are the
+ * ones eval -g suggests for a workload, it prints them in this form.
+ * The VM handlers, the decoders and the decomp printers are generated
+ * from this table, NONE pads the two op rows. */
+#define SUPERS(X)						\
+	X(CONS_BIND_LEX_CONS, CONS, BIND_LEX, CONS)		\
+	X(CONS_CONS, CONS, CONS, NONE)				\
+	X(BIND_LEX_CONS, BIND_LEX, CONS, NONE)			\
+	X(CONS_BIND_LEX, CONS, BIND_LEX, NONE)			\
+	X(CONS_TEE_LEX_LOAD_LEX, CONS, TEE_LEX, LOAD_LEX)	\
+	X(CONS_MUL, CONS, MUL, NONE)				\
+	X(CONS_SUB, CONS, SUB, NONE)				\
+	X(CONS_CONS_SUB, CONS, CONS, SUB)
+
+#define OP_NONE 0xff
+#define SUPER_MAX 3
+
 typedef enum {
-	OP_RET,
-	OP_BIND_LEX,
-	OP_BIND_DYN,
-	OP_LOAD_DYN,
-	OP_LOAD_LEX,
-	OP_CONS,
-	OP_NEG,
-	OP_ADD,
-	OP_SUB,
-	OP_MUL,
-	OP_DIV,
+#define X(name, arg) OP_##name,
+	OPS(X)
+#undef X
+#define X(name, a, b, c) OP_##name,
+	SUPERS(X)
+#undef X
+	OP_COUNT,
 } OpCode;
 
+enum { QUICK_II, QUICK_DD, QUICK_ID, QUICK_KINDS };
+
+#define OP_QUICK(op, kind) (OP_ADD_II + ((op) - OP_ADD) * QUICK_KINDS + (kind))
+#define OP_QUICKP(op)      ((op) >= OP_ADD_II && (op) <= OP_DIV_ID)
+/* the generic op of a quickened one, anything else as is */
+#define OP_GENERIC(op)     (OP_QUICKP(op) ? OP_ADD + ((op) - OP_ADD_II) / QUICK_KINDS : (op))
+
+#define OP_ONE(name, arg) + 1
+#define OP_SUPER_BASE (0 OPS(OP_ONE))
+#define OP_SUPERP(op) ((op) >= OP_SUPER_BASE && (op) < OP_COUNT)
+
+/* the ops a superinstruction is made of, OP_NONE past the last */
+extern const uint8_t SUPER[][SUPER_MAX];
+/* the OPARG_ of each op of OPS */
+extern const uint8_t OPARG[];
+
+/* the parts of `op' into `parts', just OP_GENERIC(op) for anything but
+ * a superinstruction, returns how many */
+static inline int
+superparts(uint8_t op, uint8_t parts[SUPER_MAX])
+{
+	int n = 0;
+	if (!OP_SUPERP(op)) {
+		parts[0] = OP_GENERIC(op);
+		return 1;
+	}
+	while (n < SUPER_MAX && SUPER[op - OP_SUPER_BASE][n] != OP_NONE) {
+		parts[n] = SUPER[op - OP_SUPER_BASE][n];
+		n++;
+	}
+	return n;
+}
+
+/* Operands are unsigned LEB128: 7 bits a byte, low bits first, the top
+ * bit set on every byte but the last. Below 128 it's a single byte. */
+static inline size_t
+uleb(const uint8_t *p, size_t *len)
+{
+	const uint8_t *s = p;
+	size_t val = 0;
+	int shift = 0;
+	do {
+		val |= (size_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*len = p - s;
+	return val;
+}
+
 void chunkfree(Chunk *chunk);
+/* 1 if `op' takes an operand */
+int ophasarg(uint8_t op);
+/* offset of the instruction after the one at `offset' */
+size_t opnext(Chunk *chunk, size_t offset);
 
-Chunk *chunknew(void);
+/* nil `pool' gives the chunk one of its own */
+Chunk *chunknew(Pool *pool);
+Pool *poolnew(void);
+/* drops a reference, frees the pool with the last one */
+void poolfree(Pool *pool);
+/* index of `val' in the pool, added if it's not there yet */
+size_t poolput(Pool *pool, Value val);
+/* same for a string of `len' bytes, copied unless it's there already */
+size_t poolstr(Pool *pool, const char *str, size_t len);
 Comp *compnew(Chunk *chunk);
 
 void compfree(Comp *comp);
+/* a byte of code as it is, without the stack bookkeeping of emit */
+void chunkput(Chunk *chunk, uint8_t byte, Range pos);
 void emit(Comp *comp, uint8_t byte, Range pos);
+void emitarg(Comp *comp, size_t arg, Range pos);
 
 Range whereis(Chunk *chunk, ptrdiff_t offset);
+/* rewrites the code of a chunk that hasn't run yet, level 2 also fuses
+ * superinstructions, returns the bytes it saved (negative if it grew) */
+ptrdiff_t peephole(Chunk *chunk, int level);
 
 void emitcons(Comp *comp, Value val, Range pos);
 
 void envnew(Comp *comp);
 void envend(Comp *comp);
 
-size_t emitload(Comp *comp, const char *name, Range pos);
-size_t emitbind(Comp *comp, const char *name, Range pos);
+size_t emitload(Comp *comp, Symbol *name, Range pos);
+size_t emitbind(Comp *comp, Symbol *name, Range pos);
+/* a lexical slot without a name, it's free again at envend */
+size_t maketemp(Comp *comp);
 
-void emitbind_dyn(Comp *comp, const char *name, Range pos);
-void emitload_dyn(Comp *comp, const char *name, Range pos);
+void emitbind_dyn(Comp *comp, Symbol *name, Range pos);
+void emitload_dyn(Comp *comp, Symbol *name, Range pos);
@@ -1,4 +1,5 @@
 #include "aux.h"
+#include "sym.h"
 #include "types/arena.h"
 #include "types/value.h"
 #include "types/sexp.h"
@@ -7,6 +8,7 @@
 #include "read.h"
 #include "compi.h"
 #include "comp.h"
+#include "reg.h"
 #include "decomp.h"
 
 static ptrdiff_t
@@ -17,18 +19,62 @@ op_basic(const char *name, ptrdiff_t offset)
 }
 
 static ptrdiff_t
-op_comp(Chunk *chunk, const char *name, ptrdiff_t offset, size_t arglen)
+op_comp(Chunk *chunk, const char *name, ptrdiff_t offset)
 {
+	char buff[atoi(ARGS_COL)];
+	size_t len, idx = uleb(chunk->code + offset + 1, &len);
 	printf("%-"CODE_COL"s ; ", name);
-	for (int i = 0; arglen - i > 0; i++) {
-		char buff[atoi(ARGS_COL)];
-		size_t idx = chunk->code[offset + i + 1];
-		snprintf(buff, atoi(ARGS_COL), "%s", valuestr(chunk->conspool[idx]));
-		printf("%s", buff);
-		if (i - 1 > 0) printf(", ");
+	snprintf(buff, atoi(ARGS_COL), "%s", valuestr(chunk->pool->vals[idx]));
+	printf("%s\n", buff);
+	return offset + 1 + len;
+}
+
+/* the operand is the slot itself */
+static ptrdiff_t
+op_slot(Chunk *chunk, const char *name, ptrdiff_t offset)
+{
+	size_t len, slot = uleb(chunk->code + offset + 1, &len);
+	printf("%-"CODE_COL"s ; %zu\n", name, slot);
+	return offset + 1 + len;
+}
+
+/* operands of the parts in order, constants as values, slots as is */
+static ptrdiff_t
+op_super(Chunk *chunk, const char *name, ptrdiff_t offset)
+{
+	char buff[BUFSIZ], *p = buff, *end = buff + sizeof(buff);
+	uint8_t parts[SUPER_MAX];
+	size_t len, next = offset + 1;
+	int n = superparts(chunk->code[offset], parts);
+	*p = '\0';
+	for (int i = 0; i < n; i++) {
+		if (!ophasarg(parts[i])) continue;
+		size_t arg = uleb(chunk->code + next, &len);
+		next += len;
+		if (p > buff && p < end) p += snprintf(p, end - p, ", ");
+		if (p >= end) continue;
+		if (OPARG[parts[i]] == OPARG_K)
+			p += snprintf(p, end - p, "%s", valuestr(chunk->pool->vals[arg]));
+		else
+			p += snprintf(p, end - p, "%zu", arg);
 	}
-	putchar('\n');
-	return offset + arglen + 1;
+	printf("%-"CODE_COL"s ; %s\n", name, buff);
+	return next;
+}
+
+static const char *OPNAME[OP_COUNT] = {
+#define X(name, arg) [OP_##name] = #name,
+	OPS(X)
+#undef X
+#define X(name, a, b, c) [OP_##name] = #name,
+	SUPERS(X)
+#undef X
+};
+
+const char *
+opname(int op)
+{
+	return op >= 0 && op < OP_COUNT && OPNAME[op] ? OPNAME[op] : "UNKNOWN";
 }
 
 static void
@@ -67,23 +113,16 @@ decompile_op_(Chunk *chunk, ptrdiff_t offset)
 	lastrange = where;
 
 	uint8_t instr = chunk->code[offset];
-	switch (instr) {
-	case OP_LOAD_DYN: return op_comp(chunk, "LOAD_DYN", offset, 1);
-	case OP_BIND_DYN: return op_comp(chunk, "BIND_DYN", offset, 1);
-	case OP_LOAD_LEX: return op_comp(chunk, "LOAD_LEX", offset, 1);
-	case OP_BIND_LEX: return op_comp(chunk, "BIND_LEX", offset, 1);
-	case OP_CONS:     return op_comp(chunk, "CONS", offset, 1);
-	case OP_RET:      return op_basic("RET", offset);
-	case OP_NEG:      return op_basic("NEG", offset);
-	case OP_ADD:      return op_basic("ADD", offset);
-	case OP_SUB:      return op_basic("SUB", offset);
-	case OP_MUL:      return op_basic("MUL", offset);
-	case OP_DIV:      return op_basic("DIV", offset);
-	default:
+	if (instr >= OP_COUNT) {
 		printf("; Unknown opcode %d\n", instr);
 		return offset + 1;
 	}
-
+	if (OP_SUPERP(instr)) return op_super(chunk, OPNAME[instr], offset);
+	switch (OPARG[instr]) {
+	case OPARG_K:    return op_comp(chunk, OPNAME[instr], offset);
+	case OPARG_SLOT: return op_slot(chunk, OPNAME[instr], offset);
+	default:         return op_basic(OPNAME[instr], offset);
+	}
 }
 
 ptrdiff_t
@@ -101,5 +140,94 @@ decompile(Chunk *chunk, const char *name)
 	for (size_t offset = 0; offset < vec_len(chunk->code);)
 		offset = decompile_op_(chunk, offset);
 	printf(";\n");
+	Pool *pool = chunk->pool;
+	printf(";;; POOL %zu CONSTANTS %zu/%zu HITS %.1f%%%s\n",
+	       vec_len(pool->vals), pool->hits, pool->lookups,
+	       pool->lookups ? 100.0 * pool->hits / pool->lookups : 0.0,
+	       pool->refs > 1 ? " SHARED" : "");
 	printf(";;; [END]\n");
 }
+
+/* the arithmetic sites with what they're quickened to now and their
+ * counters, hits are only counted with -DQUICK_STATS */
+void
+decompile_quick(Chunk *chunk)
+{
+	static const char *kinds[] = { "II", "DD", "ID" };
+	static const char *names[] = { "ADD", "SUB", "MUL", "DIV" };
+	if (!chunk->quick) return;
+	for (size_t offset = 0; offset < vec_len(chunk->code);) {
+		uint8_t op = chunk->code[offset];
+		Quick *q = &chunk->quick[offset];
+		if (OP_GENERIC(op) >= OP_ADD && OP_GENERIC(op) <= OP_DIV) {
+			printf(";;; QUICK %0"BYTE_COL"zu %s %-7s %8u HITS %8u MISSES\n",
+			       offset, names[OP_GENERIC(op) - OP_ADD],
+			       OP_QUICKP(op) ? kinds[(op - OP_ADD_II) % QUICK_KINDS] : "GENERIC",
+			       (unsigned)q->hits, (unsigned)q->misses);
+		}
+		offset = opnext(chunk, offset);
+	}
+}
+
+static const char *RNAME[] = {
+#define X(name, args) [R_##name] = #name,
+	ROPS(X)
+#undef X
+};
+
+static const char *RARGS[] = {
+#define X(name, args) [R_##name] = args,
+	ROPS(X)
+#undef X
+};
+
+/* operand letters as in reg.h: d, a, b registers, k constant */
+static ptrdiff_t
+rop(RChunk *rc, const char *name, const char *args, ptrdiff_t offset)
+{
+	char buff[BUFSIZ], *p = buff, *end = buff + sizeof(buff);
+	const uint8_t *arg = rc->code + offset + 1;
+	*p = '\0';
+	for (const char *c = args; *c; c++) {
+		const char *sep = c[1] ? ", " : "";
+		size_t len = 1;
+		if (*c == 'k') {
+			Value k = rc->chunk->pool->vals[uleb(arg, &len)];
+			if (p < end) p += snprintf(p, end - p, "%s%s", valuestr(k), sep);
+		} else if (p < end) {
+			p += snprintf(p, end - p, "r%d%s", *arg, sep);
+		}
+		arg += len;
+	}
+	printf("%-"CODE_COL"s ; %s\n", name, buff);
+	return arg - rc->code;
+}
+
+void
+rdecompile(RChunk *rc, const char *name)
+{
+	Range lastrange = {0};
+	decompile_header(name);
+	for (size_t offset = 0, i = 0; offset < vec_len(rc->code); i++) {
+		Range where = whereis(rc->chunk, rc->from[i]);
+		printf("; %0"BYTE_COL"ld ; ", offset);
+		if (offset > 0 && lastrange.at == where.at) {
+			printf("%-"WHERE_COL"s ", "-");
+		} else {
+			char buff[BUFSIZ];
+			snprintf(buff, BUFSIZ, "%-4ld %ld ", where.at, where.len);
+			printf("%-8s", buff);
+		}
+		printf("; ");
+		lastrange = where;
+		uint8_t op = rc->code[offset];
+		if (op < R_COUNT) {
+			offset = rop(rc, RNAME[op], RARGS[op], offset);
+		} else {
+			printf("; Unknown opcode %d\n", op);
+			offset++;
+		}
+	}
+	printf(";\n");
+	printf(";;; [END] %zu REGISTERS\n", rc->nregs);
+}
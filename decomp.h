@@ -7,5 +7,8 @@
 	";;; %s\n; %-" BYTE_COL "s ; %-" WHERE_COL "s ; %-" CODE_COL           \
 	"s ; %-" ARGS_COL "s"
 
+const char *opname(int op);
 ptrdiff_t decompile_op(Chunk *chunk, ptrdiff_t offset);
 void decompile(Chunk *chunk, const char *name);
+void decompile_quick(Chunk *chunk);
+void rdecompile(RChunk *rc, const char *name);
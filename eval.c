@@ -1,4 +1,6 @@
+#include <stdatomic.h>
 #include "aux.h"
+#include "sym.h"
 #include "types/vec.h"
 #include "types/value.h"
 #include "types/arena.h"
@@ -6,11 +8,12 @@
 #include "types/ht.h"
 #include "read.h"
 #include "compi.h"
+#include "reg.h"
 #include "decomp.h"
 #include "comp.h"
-
-#define STACK_MAX 4096
-#define VM_TRACE 1
+#include "trace.h"
+#include "jit.h"
+#include "heap.h"
 
 /*;; Glorious Lisp Virtual Machine (GLVM) ;;*/
 typedef enum {
@@ -24,25 +27,51 @@ typedef struct {
 	size_t idx;
 } Bind;
 
+/* opcode bigram and trigram counts of run(), for eval -g */
+typedef struct {
+	uint64_t two[OP_COUNT][OP_COUNT];
+	uint64_t three[OP_COUNT][OP_COUNT][OP_COUNT];
+	int prev[2];		/* the two ops before, -1 at the chunk start */
+} Ngram;
+
 typedef struct {
 	uint8_t *ip;
 	Chunk *chunk;
+	Value *cons;		/* chunk->pool->vals, one load less for CONS */
 	Value stack[STACK_MAX];
 	Ht(Value) dynamic;
 	Value *bsp;
 	Value *sp;
+	Trace *trace;		/* nil unless eval -t */
+	int counting;		/* count steps, for eval -b */
+	Ngram *ngram;		/* nil unless eval -g */
+	size_t steps;
+	int jiterr;		/* jitslow() reported an error, see runjit() */
+	Value ret;
 } VM;
 
 static VM vm;
 
 #define VM_INCIP() (*vm.ip++)
-#define VM_CONS() vm.chunk->conspool[VM_INCIP()]
+/* one byte operands are the common case, only longer ones are decoded */
+#define VM_ARG() (*vm.ip < 0x80 ? *vm.ip++ : vmarg())
+#define VM_CONS() vm.cons[VM_ARG()]
+
+static size_t
+vmarg(void)
+{
+	size_t len, arg = uleb(vm.ip, &len);
+	vm.ip += len;
+	return arg;
+}
 
 void
 vminit()
 {
 	vm.sp = vm.stack;
 	ht_ini(vm.dynamic);
+	ht_borrow(vm.dynamic);	/* keys are interned symbol names */
+	ht_incremental(vm.dynamic, HT_INCR_STEP);
 }
 
 void
@@ -51,6 +80,29 @@ vmfree()
 	ht_free(vm.dynamic);
 }
 
+/* every Value the VM holds, for the collector: the stack up to sp with
+ * the lexical slots, the last result and the dynamic bindings, in both
+ * tables while they're moving */
+static void
+vmroots(HeapVisit visit)
+{
+	Value *old = htptr(vm.dynamic)->old;
+	for (Value *v = vm.stack; v < vm.sp; v++) visit(v);
+	visit(&vm.ret);
+	for (size_t i = 0; i < htptr(vm.dynamic)->cap; i++)
+		if (ht_idxp(vm.dynamic, i)) visit(&vm.dynamic[i]);
+	for (size_t i = 0; old && i < htptr(old)->cap; i++)
+		if (ht_idxp(old, i)) visit(&old[i]);
+}
+
+/* an unbound variable is nil */
+static Value
+dynget(Symbol *sym)
+{
+	size_t idx = ht_find_idx_h(vm.dynamic, sym->name, sym->hash);
+	return ht_idxp(vm.dynamic, idx) ? vm.dynamic[idx] : NIL;
+}
+
 void push(Value value) { *vm.sp++ = value; }
 Value pop(void)  { return *(--vm.sp); }
 Value peek(void) { return *(vm.sp); }
@@ -70,139 +122,856 @@ framedel()
 }
 
 
-#define BIN_OP(op) do {							\
+/* Int `a op b' wrapping around like the constant folder in comp.c, 0
+ * for a division that would trap. */
+static inline int
+iarith(int op, Value a, Value b, Value *res)
+{
+	uint32_t x = AS_INT(a), y = AS_INT(b);
+	switch (op) {
+	case OP_ADD: *res = TO_INT((int32_t)(x + y)); return 1;
+	case OP_SUB: *res = TO_INT((int32_t)(x - y)); return 1;
+	case OP_MUL: *res = TO_INT((int32_t)(x * y)); return 1;
+	}
+	if (!y || (x == (uint32_t)INT32_MIN && y == (uint32_t)-1)) return 0;
+	*res = TO_INT(AS_INT(a) / AS_INT(b));
+	return 1;
+}
+
+static EvalErr
+diverr(Value a, Value b)
+{
+	printf("; The division\n;\t%d / %d\n; is undefined\n", AS_INT(a), AS_INT(b));
+	return RUNTIME_ERR;
+}
+
+/* `fail' is called with the operands of a division iarith() refused */
+#define BIN_OP(opc, op, fail) do {					\
 		Value b_ = pop();					\
 		Value a_ = pop();					\
+		Value r_;						\
 		if (DOUBLP(a_) || DOUBLP(b_))				\
 			push(TO_DOUBL(AS_NUM(a_) op AS_NUM(b_)));	\
+		else if (iarith(opc, a_, b_, &r_))			\
+			push(r_);					\
 		else							\
-			push(TO_INT(AS_INT(a_) op AS_INT(b_)));		\
+			fail(a_, b_);					\
 	} while (0);
+#define VM_FAIL(a, b) return diverr(a, b)
 
 
-void
-printstack()
+/* With GCC/Clang every handler jumps straight to the next one through
+ * the table of label addresses, elsewhere it's a switch in a loop.
+ * Define VM_SWITCH to get the switch anyway. */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VM_SWITCH)
+#define VM_THREADED 1
+#endif
+
+#ifdef VM_THREADED
+#define VM_CASE(op) L_##op
+#define VM_NEXT()   goto *dispatch[VM_INCIP()]
+#else
+#define VM_CASE(op) case op
+#define VM_NEXT()   continue
+#endif
+
+#define QUICK_DEOPT_MAX 4	/* sites that failed this often stay generic */
+#define QUICK_SITE() (&vm.chunk->quick[vm.ip - 1 - vm.chunk->code])
+#ifdef QUICK_STATS
+#define QUICK_HIT() QUICK_SITE()->hits++
+#else
+#define QUICK_HIT() (void)0
+#endif
+
+/* rewrite the generic op just read to the variant for `a' and `b' */
+static void
+quicken(int op, Value a, Value b)
+{
+	if (QUICK_SITE()->misses >= QUICK_DEOPT_MAX) return;
+	if (INTP(a) && INTP(b))
+		vm.ip[-1] = OP_QUICK(op, QUICK_II);
+	else if (DOUBLP(a) && DOUBLP(b))
+		vm.ip[-1] = OP_QUICK(op, QUICK_DD);
+	else if (NUMP(a) && NUMP(b))
+		vm.ip[-1] = OP_QUICK(op, QUICK_ID);
+}
+
+/* These expand to blocks and not do/while, VM_NEXT() may be continue. */
+#define ARITH(opc, op) {						\
+		quicken(opc, vm.sp[-2], vm.sp[-1]);			\
+		BIN_OP(opc, op, VM_FAIL);				\
+		VM_NEXT();						\
+	}
+
+/* guard failed, the site goes back to the generic op */
+#define DEOPT(opc, op) {						\
+		vm.ip[-1] = opc;					\
+		QUICK_SITE()->misses++;					\
+		BIN_OP(opc, op, VM_FAIL);				\
+		VM_NEXT();						\
+	}
+
+#define ARITH_II(opc, op) {						\
+		Value b_ = vm.sp[-1], a_ = vm.sp[-2];			\
+		if (!INTP(a_) || !INTP(b_)) DEOPT(opc, op);		\
+		QUICK_HIT();						\
+		if (!iarith(opc, a_, b_, &vm.sp[-2]))			\
+			return diverr(a_, b_);				\
+		vm.sp--;						\
+		VM_NEXT();						\
+	}
+
+#define ARITH_DD(opc, op) {						\
+		Value b_ = vm.sp[-1], a_ = vm.sp[-2];			\
+		if (!DOUBLP(a_) || !DOUBLP(b_)) DEOPT(opc, op);		\
+		QUICK_HIT();						\
+		vm.sp[-2] = TO_DOUBL(AS_DOUBL(a_) op AS_DOUBL(b_));	\
+		vm.sp--;						\
+		VM_NEXT();						\
+	}
+
+#define NUM_(v) (INTP(v) ? AS_INT(v) : AS_DOUBL(v))
+#define ARITH_ID(opc, op) {						\
+		Value b_ = vm.sp[-1], a_ = vm.sp[-2];			\
+		if (INTP(a_) == INTP(b_) || !NUMP(a_) || !NUMP(b_))	\
+			DEOPT(opc, op);					\
+		QUICK_HIT();						\
+		vm.sp[-2] = TO_DOUBL(NUM_(a_) op NUM_(b_));		\
+		vm.sp--;						\
+		VM_NEXT();						\
+	}
+
+#define STRINGP(v) (STRP(v) || HSTRP(v))
+
+static const char *
+strof(Value val, size_t *len)
 {
-	printf(";;; STACK BEG\n");
-	for (Value* slot = vm.stack; slot < vm.sp; slot++) {
-		printf(" %s ", valuestr(*slot));
-		if (slot + 1 < vm.sp) putchar('|');
+	if (HSTRP(val)) {
+		*len = AS_HSTR(val)->len;
+		return AS_HSTR(val)->str;
 	}
-	printf("\n;;; STACK END\n");
+	*len = strlen(AS_PTR(val));
+	return AS_PTR(val);
 }
 
+/* String constants belong to the pool of their chunk, `val' gets a heap
+ * copy before it's stored anywhere that outlives the chunk. It must be
+ * on the roots, this may collect. */
+static void
+vmkeep(Value *val)
+{
+	Value str = *val;
+	if (!STRP(str)) return;
+	size_t len = strlen(AS_PTR(str));
+	Str *s = heapstr(len);
+	memcpy(s->str, AS_PTR(str), len + 1);
+	*val = TO_OBJ(s);
+}
+
+/* Allocating may collect and move the operands, they're only read from
+ * the stack after it. Type errors are reported and give nil. */
+static void
+vmpair(void)
+{
+	vmkeep(&vm.sp[-2]);
+	vmkeep(&vm.sp[-1]);
+	Pair *p = heappair();
+	p->cdr = pop();
+	p->car = pop();
+	push(TO_OBJ(p));
+}
+
+static void
+vmcarcdr(int cdr)
+{
+	Value val = pop();
+	if (NILP(val) || ASSERTV(PAIRP, val)) push(NIL);
+	else push(cdr ? AS_PAIR(val)->cdr : AS_PAIR(val)->car);
+}
+
+static void
+vmconcat(void)
+{
+	size_t alen, blen;
+	if (ASSERTV(STRINGP, vm.sp[-2]) || ASSERTV(STRINGP, vm.sp[-1])) {
+		vm.sp -= 2;
+		push(NIL);
+		return;
+	}
+	strof(vm.sp[-2], &alen);
+	strof(vm.sp[-1], &blen);
+	Str *s = heapstr(alen + blen);
+	memcpy(s->str, strof(vm.sp[-2], &alen), alen);
+	memcpy(s->str + alen, strof(vm.sp[-1], &blen), blen);
+	s->str[alen + blen] = '\0';
+	vm.sp -= 2;
+	push(TO_OBJ(s));
+}
+
+static void
+vmset(int cdr)
+{
+	vmkeep(&vm.sp[-1]);
+	Value val = pop(), pair = pop();
+	if (!ASSERTV(PAIRP, pair))
+		heapset(AS_OBJ(pair), cdr ? &AS_PAIR(pair)->cdr : &AS_PAIR(pair)->car, val);
+	push(val);
+}
+
+static void
+trace(void)
+{
+	size_t depth = vm.sp - vm.stack;
+	vm.steps++;
+	if (vm.trace)
+		traceev(vm.trace, vm.ip - vm.chunk->code, *vm.ip, depth,
+			depth ? vm.sp[-1] : TO_INT(0));
+	if (vm.ngram) {
+		Ngram *g = vm.ngram;
+		int op = OP_GENERIC(*vm.ip);
+		if (vm.ip == vm.chunk->code) g->prev[0] = g->prev[1] = -1;
+		if (g->prev[1] >= 0) g->two[g->prev[1]][op]++;
+		if (g->prev[0] >= 0) g->three[g->prev[0]][g->prev[1]][op]++;
+		g->prev[0] = g->prev[1];
+		g->prev[1] = op;
+	}
+}
+
+/* The ops as statements, for the handlers and SUPERS. */
+#define DO_NONE()
+#define DO_BIND_DYN() {							\
+		Symbol *bind = AS_SYM(VM_CONS());			\
+		vmkeep(&vm.sp[-1]);					\
+		ht_set_h(vm.dynamic, bind->name, bind->hash, pop());	\
+	}
+#define DO_LOAD_DYN() {							\
+		Symbol *bind = AS_SYM(VM_CONS());			\
+		push(dynget(bind));					\
+	}
+#define DO_BIND_LEX() {							\
+		size_t slot = VM_ARG();					\
+		vm.bsp[slot] = pop();					\
+	}
+#define DO_LOAD_LEX() {							\
+		size_t slot = VM_ARG();					\
+		push(vm.bsp[slot]);					\
+	}
+#define DO_TEE_LEX() {							\
+		size_t slot = VM_ARG();					\
+		vm.bsp[slot] = vm.sp[-1];				\
+	}
+#define DO_CONS() {							\
+		Value val = VM_CONS();					\
+		push(val);						\
+	}
+/* a non-number is reported and dropped */
+#define DO_NEG() {							\
+		Value val = pop();					\
+		if (ASSERTV(NUMP, val)) {}				\
+		else if INTP(val) push(TO_INT(-(uint32_t)AS_INT(val)));	\
+		else push(TO_DOUBL(-AS_DOUBL(val)));			\
+	}
+/* Only SUPERS use these. A superinstruction can't be rewritten to the
+ * quickened variant of one of its parts, so the II case is checked for
+ * inline the way ARITH_II does and the rest is left to BIN_OP. */
+#define DO_ARITH(opc, op) {						\
+		Value b_ = vm.sp[-1], a_ = vm.sp[-2];			\
+		if (INTP(a_) && INTP(b_)) {				\
+			if (!iarith(opc, a_, b_, &vm.sp[-2]))		\
+				return diverr(a_, b_);			\
+			vm.sp--;					\
+		} else BIN_OP(opc, op, VM_FAIL)				\
+	}
+#define DO_ADD() DO_ARITH(OP_ADD, +)
+#define DO_SUB() DO_ARITH(OP_SUB, -)
+#define DO_MUL() DO_ARITH(OP_MUL, *)
+#define DO_DIV() DO_ARITH(OP_DIV, /)
+#define DO_PAIR()   { vmpair(); }
+#define DO_CAR()    { vmcarcdr(0); }
+#define DO_CDR()    { vmcarcdr(1); }
+#define DO_CONCAT() { vmconcat(); }
+#define DO_SETCAR() { vmset(0); }
+#define DO_SETCDR() { vmset(1); }
+
+#ifdef VM_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
 EvalErr
 run()
 {
-	int i = 0;
+#ifdef VM_THREADED
+	static const void *handlers[256] = {
+		[0 ... 255]   = &&L_UNKNOWN,
+		[OP_BIND_DYN] = &&L_OP_BIND_DYN,
+		[OP_LOAD_DYN] = &&L_OP_LOAD_DYN,
+		[OP_BIND_LEX] = &&L_OP_BIND_LEX,
+		[OP_LOAD_LEX] = &&L_OP_LOAD_LEX,
+		[OP_TEE_LEX]  = &&L_OP_TEE_LEX,
+		[OP_PAIR]     = &&L_OP_PAIR,
+		[OP_CAR]      = &&L_OP_CAR,
+		[OP_CDR]      = &&L_OP_CDR,
+		[OP_CONCAT]   = &&L_OP_CONCAT,
+		[OP_SETCAR]   = &&L_OP_SETCAR,
+		[OP_SETCDR]   = &&L_OP_SETCDR,
+		[OP_CONS]     = &&L_OP_CONS,
+		[OP_NEG]      = &&L_OP_NEG,
+		[OP_ADD]      = &&L_OP_ADD,
+		[OP_SUB]      = &&L_OP_SUB,
+		[OP_MUL]      = &&L_OP_MUL,
+		[OP_DIV]      = &&L_OP_DIV,
+		[OP_RET]      = &&L_OP_RET,
+		[OP_ADD_II]   = &&L_OP_ADD_II,
+		[OP_ADD_DD]   = &&L_OP_ADD_DD,
+		[OP_ADD_ID]   = &&L_OP_ADD_ID,
+		[OP_SUB_II]   = &&L_OP_SUB_II,
+		[OP_SUB_DD]   = &&L_OP_SUB_DD,
+		[OP_SUB_ID]   = &&L_OP_SUB_ID,
+		[OP_MUL_II]   = &&L_OP_MUL_II,
+		[OP_MUL_DD]   = &&L_OP_MUL_DD,
+		[OP_MUL_ID]   = &&L_OP_MUL_ID,
+		[OP_DIV_II]   = &&L_OP_DIV_II,
+		[OP_DIV_DD]   = &&L_OP_DIV_DD,
+		[OP_DIV_ID]   = &&L_OP_DIV_ID,
+#define X(name, a, b, c) [OP_##name] = &&L_OP_##name,
+		SUPERS(X)
+#undef X
+	};
+	/* tracing reroutes every opcode through L_TRACE */
+	static const void *traced[256] = { [0 ... 255] = &&L_TRACE };
+	const void **dispatch = vm.trace || vm.counting || vm.ngram ? traced : handlers;
+	VM_NEXT();
+L_TRACE:
+	vm.ip--;
+	trace();
+	goto *handlers[VM_INCIP()];
+#else
 	for (;;) {
-#ifdef VM_TRACE
-		printf(";;;; [CYCLE %04i] ;;;;;\n", ++i);
-		decompile_op(vm.chunk, vm.ip - vm.chunk->code);
-		printstack();
-		printf(";; EXECUTING...\n");
+		if (vm.trace || vm.counting || vm.ngram) trace();
+		switch (VM_INCIP()) {
 #endif
-		uint8_t opcode;
-		switch (opcode = VM_INCIP()) {
-		case OP_BIND_DYN: {
-			const char *bind = AS_PTR(VM_CONS());
-			ht_set(vm.dynamic, bind, pop());
-			break;
-		}
-		case OP_LOAD_DYN: {
-			const char *bind = AS_PTR(VM_CONS());
-			push(ht_get(vm.dynamic, bind));
-			break;
+		VM_CASE(OP_BIND_DYN): DO_BIND_DYN(); VM_NEXT();
+		VM_CASE(OP_LOAD_DYN): DO_LOAD_DYN(); VM_NEXT();
+		VM_CASE(OP_BIND_LEX): DO_BIND_LEX(); VM_NEXT();
+		VM_CASE(OP_LOAD_LEX): DO_LOAD_LEX(); VM_NEXT();
+		VM_CASE(OP_TEE_LEX):  DO_TEE_LEX();  VM_NEXT();
+		VM_CASE(OP_CONS):     DO_CONS();     VM_NEXT();
+		VM_CASE(OP_NEG):      DO_NEG();      VM_NEXT();
+		VM_CASE(OP_PAIR):     DO_PAIR();     VM_NEXT();
+		VM_CASE(OP_CAR):      DO_CAR();      VM_NEXT();
+		VM_CASE(OP_CDR):      DO_CDR();      VM_NEXT();
+		VM_CASE(OP_CONCAT):   DO_CONCAT();   VM_NEXT();
+		VM_CASE(OP_SETCAR):   DO_SETCAR();   VM_NEXT();
+		VM_CASE(OP_SETCDR):   DO_SETCDR();   VM_NEXT();
+		VM_CASE(OP_ADD): ARITH(OP_ADD, +);
+		VM_CASE(OP_SUB): ARITH(OP_SUB, -);
+		VM_CASE(OP_MUL): ARITH(OP_MUL, *);
+		VM_CASE(OP_DIV): ARITH(OP_DIV, /);
+		VM_CASE(OP_ADD_II): ARITH_II(OP_ADD, +);
+		VM_CASE(OP_ADD_DD): ARITH_DD(OP_ADD, +);
+		VM_CASE(OP_ADD_ID): ARITH_ID(OP_ADD, +);
+		VM_CASE(OP_SUB_II): ARITH_II(OP_SUB, -);
+		VM_CASE(OP_SUB_DD): ARITH_DD(OP_SUB, -);
+		VM_CASE(OP_SUB_ID): ARITH_ID(OP_SUB, -);
+		VM_CASE(OP_MUL_II): ARITH_II(OP_MUL, *);
+		VM_CASE(OP_MUL_DD): ARITH_DD(OP_MUL, *);
+		VM_CASE(OP_MUL_ID): ARITH_ID(OP_MUL, *);
+		VM_CASE(OP_DIV_II): ARITH_II(OP_DIV, /);
+		VM_CASE(OP_DIV_DD): ARITH_DD(OP_DIV, /);
+		VM_CASE(OP_DIV_ID): ARITH_ID(OP_DIV, /);
+#define X(name, a, b, c)						\
+		VM_CASE(OP_##name): DO_##a(); DO_##b(); DO_##c(); VM_NEXT();
+		SUPERS(X)
+#undef X
+		VM_CASE(OP_RET): {
+			vm.ret = pop();
+			return OK;
 		}
-		case OP_BIND_LEX: {
-			size_t slot = AS_INT(VM_CONS());
-			vm.sp[slot] = pop();
-			break;
+#ifdef VM_THREADED
+L_UNKNOWN:
+		assert(0 && "unreachable");
+		return RUNTIME_ERR;
+#else
+		default: assert(0 && "unreachable");
 		}
-		case OP_LOAD_LEX: {
-			size_t slot = AS_INT(VM_CONS());
-			push(vm.sp[slot]);
-			break;
+	}
+#endif
+}
+#ifdef VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+/* The register VM keeps ip and the frame in locals, the operands are
+ * read relative to ip and it's bumped once per instruction. */
+#define R_D ip[1]
+#define R_A ip[2]
+#define R_B ip[3]
+/* the k operand after one register, sets klen to its length */
+#define R_K() (ip[2] < 0x80 ? (klen = 1, ip[2]) : uleb(ip + 2, &klen))
+
+#ifdef VM_THREADED
+#define R_NEXT(len) do { ip += (len); goto *dispatch[*ip]; } while (0)
+#else
+#define R_NEXT(len) do { ip += (len); goto R_LOOP; } while (0)
+#endif
+
+#define RBIN_OP(opc, op) do {					\
+		Value a_ = r[R_A];					\
+		Value b_ = r[R_B];					\
+		if (DOUBLP(a_) || DOUBLP(b_))				\
+			r[R_D] = TO_DOUBL(AS_NUM(a_) op AS_NUM(b_));	\
+		else if (!iarith(opc, a_, b_, &r[R_D]))		\
+			return diverr(a_, b_);				\
+		R_NEXT(4);						\
+	} while (0)
+
+#ifdef VM_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+EvalErr
+rrun(RChunk *rc)
+{
+	const uint8_t *ip = rc->code;
+	Value *r = vm.bsp;
+	Value *cons = rc->chunk->pool->vals;
+	size_t klen;
+	/* the registers are roots, vmkeep may collect */
+	for (; vm.sp < r + rc->nregs; vm.sp++) *vm.sp = NIL;
+#ifdef VM_THREADED
+	static const void *handlers[256] = {
+		[0 ... 255]  = &&L_UNKNOWN,
+		[R_RET]      = &&L_R_RET,
+		[R_MOV]      = &&L_R_MOV,
+		[R_CONS]     = &&L_R_CONS,
+		[R_BIND_DYN] = &&L_R_BIND_DYN,
+		[R_LOAD_DYN] = &&L_R_LOAD_DYN,
+		[R_NEG]      = &&L_R_NEG,
+		[R_ADD]      = &&L_R_ADD,
+		[R_SUB]      = &&L_R_SUB,
+		[R_MUL]      = &&L_R_MUL,
+		[R_DIV]      = &&L_R_DIV,
+	};
+	static const void *counted[256] = { [0 ... 255] = &&L_COUNT };
+	const void **dispatch = vm.counting ? counted : handlers;
+	R_NEXT(0);
+L_COUNT:
+	vm.steps++;
+	goto *handlers[*ip];
+#else
+	for (;;) {
+R_LOOP:
+		if (vm.counting) vm.steps++;
+		switch (*ip) {
+#endif
+		VM_CASE(R_MOV): r[R_D] = r[R_A]; R_NEXT(3);
+		VM_CASE(R_CONS): r[R_D] = cons[R_K()]; R_NEXT(2 + klen);
+		VM_CASE(R_BIND_DYN): {
+			Symbol *bind = AS_SYM(cons[R_K()]);
+			vmkeep(&r[ip[1]]);
+			ht_set_h(vm.dynamic, bind->name, bind->hash, r[ip[1]]);
+			R_NEXT(2 + klen);
 		}
-		case OP_CONS: {
-		        Value val = VM_CONS();
-			push(val);
-			break;
+		VM_CASE(R_LOAD_DYN): {
+			Symbol *bind = AS_SYM(cons[R_K()]);
+			r[R_D] = dynget(bind);
+			R_NEXT(2 + klen);
 		}
-		case OP_NEG:{
-			Value val = pop();
-			if (ASSERTV(NUMP, val)) break;
-			if INTP(val) push(TO_INT(-AS_INT(val)));
-			else if DOUBLP(val) push(TO_DOUBL(-AS_DOUBL(val)));
-			break;
+		VM_CASE(R_NEG): {
+			Value val = r[R_A];
+			if (ASSERTV(NUMP, val)) R_NEXT(3);
+			if INTP(val) r[R_D] = TO_INT(-(uint32_t)AS_INT(val));
+			else if DOUBLP(val) r[R_D] = TO_DOUBL(-AS_DOUBL(val));
+			R_NEXT(3);
 		}
-		case OP_ADD: BIN_OP(+); break;
-		case OP_SUB: BIN_OP(-); break;
-		case OP_MUL: BIN_OP(*); break;
-		case OP_DIV: BIN_OP(/); break;
-		case OP_RET: {
-			printf(";; STACK TOP: %s\n", valuestr(pop()));
-			printf("; TERMINATING\n");
+		VM_CASE(R_ADD): RBIN_OP(OP_ADD, +);
+		VM_CASE(R_SUB): RBIN_OP(OP_SUB, -);
+		VM_CASE(R_MUL): RBIN_OP(OP_MUL, *);
+		VM_CASE(R_DIV): RBIN_OP(OP_DIV, /);
+		VM_CASE(R_RET): {
+			vm.ret = r[ip[1]];
 			return OK;
 		}
+#ifdef VM_THREADED
+L_UNKNOWN:
+		assert(0 && "unreachable");
+		return RUNTIME_ERR;
+#else
 		default: assert(0 && "unreachable");
 		}
-#ifdef VM_TRACE
-		printf("\n;; OK\n");
-		printstack();
+	}
 #endif
+}
+#ifdef VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+static int regvm;		/* eval -r */
+static long bench;		/* eval -b */
+static long jitafter = -1;	/* eval -j, runs before a chunk gets native code */
+static int jitcheck;		/* eval -d, compare native code with run() */
+static int quickstats;		/* eval -q */
+static long optlevel = 2;	/* eval -O, see peephole */
+
+static void
+vmload(Chunk *chunk)
+{
+	if (!chunk->quick)
+		chunk->quick = calloc(max(vec_len(chunk->code), 1), sizeof(Quick));
+	vm.chunk = chunk;
+	vm.cons = chunk->pool->vals;
+	vm.ip = chunk->code;
+	vm.bsp = vm.stack;
+	vm.sp = vm.bsp + chunk->nlocals;
+	/* what's left there from the last run is garbage to the collector */
+	for (size_t i = 0; i < chunk->nlocals; i++) vm.bsp[i] = NIL;
+}
+
+/* Native code can't stop halfway, it runs on with nil for the result
+ * and runjit() returns the error. Only the first one is reported, the
+ * slow path does nothing more after it. */
+static void
+jitfail(Value a, Value b)
+{
+	if (!vm.jiterr) diverr(a, b);
+	vm.jiterr = 1;
+	push(NIL);
+}
+
+/* the ops the JIT templates call out for, same as in run() */
+static Value *
+jitslow(Value *sp, int op, Value k)
+{
+	vm.sp = sp;
+	if (vm.jiterr) {	/* nil for whatever the op leaves */
+		switch (op) {
+		case OP_BIND_DYN: pop(); break;
+		case OP_LOAD_DYN: push(NIL); break;
+		case OP_NEG:      vm.sp[-1] = NIL; break;
+		default:          pop(); vm.sp[-1] = NIL; break;
+		}
+		return vm.sp;
+	}
+	switch (op) {
+	case OP_BIND_DYN:
+		vmkeep(&vm.sp[-1]);
+		ht_set_h(vm.dynamic, AS_SYM(k)->name, AS_SYM(k)->hash, pop());
+		break;
+	case OP_LOAD_DYN:
+		push(dynget(AS_SYM(k)));
+		break;
+	case OP_NEG: {
+		Value val = pop();
+		if (ASSERTV(NUMP, val)) break;
+		if INTP(val) push(TO_INT(-(uint32_t)AS_INT(val)));
+		else if DOUBLP(val) push(TO_DOUBL(-AS_DOUBL(val)));
+		break;
+	}
+	case OP_ADD: BIN_OP(OP_ADD, +, jitfail); break;
+	case OP_SUB: BIN_OP(OP_SUB, -, jitfail); break;
+	case OP_MUL: BIN_OP(OP_MUL, *, jitfail); break;
+	case OP_DIV: BIN_OP(OP_DIV, /, jitfail); break;
+	default: assert(0 && "unreachable");
+	}
+	return vm.sp;
+}
+
+static EvalErr
+runjit(Chunk *chunk)
+{
+	vmload(chunk);
+	vm.jiterr = 0;
+	vm.sp = chunk->jit->fn(vm.bsp, vm.sp, chunk->pool->vals);
+	vm.ret = pop();
+	return vm.jiterr ? RUNTIME_ERR : OK;
+}
+
+/* Run natively once the chunk ran `jitafter' times, with -d the
+ * interpreter runs it too and the results must match. */
+static EvalErr
+runchunk(Chunk *chunk)
+{
+	EvalErr err;
+	char *ret;
+	if (jitafter >= 0 && !chunk->jit && chunk->runs++ >= (size_t)jitafter)
+		chunk->jit = jitcompile(chunk, jitslow);
+	if (!chunk->jit) {
+		vmload(chunk);
+		return run();
+	}
+	if ((err = runjit(chunk)) != OK || !jitcheck) return err;
+	ret = strdup(objstr(vm.ret));
+	vmload(chunk);
+	if ((err = run()) == OK && strcmp(ret, objstr(vm.ret))) {
+		printf(";;; JIT MISMATCH %s", ret);
+		printf(" /= %s\n", objstr(vm.ret));
+		err = RUNTIME_ERR;
+	}
+	free(ret);
+	return err;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Run the chunk `bench' times on each VM, report the instructions
+ * executed per run and the time, and check both got the same value. */
+static EvalErr
+benchmark(Chunk *chunk, RChunk *rc)
+{
+	EvalErr err = OK;
+	char *ret;
+	double t;
+	vm.counting = 1;
+	vm.steps = 0;
+	vmload(chunk);
+	run();
+	ret = strdup(objstr(vm.ret));	/* a heap object moves */
+	printf(";;; BENCH STACK %6zu STEPS", vm.steps);
+	vm.counting = 0;
+	t = now();
+	for (long i = 0; i < bench; i++) {
+		vmload(chunk);
+		run();
+	}
+	printf(" %10.1f NS\n", (now() - t) * 1e9 / bench);
+	if (jitafter >= 0) {
+		if (!chunk->jit) chunk->jit = jitcompile(chunk, jitslow);
+		if (chunk->jit) {
+			t = now();
+			for (long i = 0; i < bench; i++) runjit(chunk);
+			printf(";;; BENCH JIT   %6s STEPS %10.1f NS\n", "-",
+			       (now() - t) * 1e9 / bench);
+			if (strcmp(ret, objstr(vm.ret))) {
+				printf(";;; BENCH MISMATCH %s", ret);
+				printf(" /= %s\n", objstr(vm.ret));
+				err = RUNTIME_ERR;
+				goto RET;
+			}
+		} else {
+			printf(";;; BENCH JIT   UNSUPPORTED\n");
+		}
+	}
+	if (!rc) {
+		printf(";;; BENCH REG   UNSUPPORTED\n");
+		goto RET;
+	}
+	vm.counting = 1;
+	vm.steps = 0;
+	vmload(chunk);
+	rrun(rc);
+	printf(";;; BENCH REG   %6zu STEPS", vm.steps);
+	vm.counting = 0;
+	t = now();
+	for (long i = 0; i < bench; i++) {
+		vmload(chunk);
+		rrun(rc);
+	}
+	printf(" %10.1f NS\n", (now() - t) * 1e9 / bench);
+	if (strcmp(ret, objstr(vm.ret))) {
+		printf(";;; BENCH MISMATCH %s", ret);
+		printf(" /= %s\n", objstr(vm.ret));
+		err = RUNTIME_ERR;
 	}
+RET:
+	free(ret);
+	return err;
 }
 
 EvalErr
-eval(Sexp *sexp)
+eval(Sexp *sexp, Pool *module)
 {
 	EvalErr err;
 	Chunk *chunk;
-	chunk = compile(sexp);
-	if (!chunk) {
-		err = COMPILE_ERR;
+	RChunk *rc = nil;
+	if (!(chunk = compile(sexp, module))) {
+		fprintf(stderr, "%zu: %s\n", compileerrat(), compileerr());
+		return COMPILE_ERR;
+	}
+	size_t size = vec_len(chunk->code);
+	if (optlevel > 0) peephole(chunk, optlevel);
+	if (bench) printf(";;; BENCH CODE  %6zu -> %zu BYTES\n", size, vec_len(chunk->code));
+	/* traces are of the stack code */
+	if ((regvm && !vm.trace) || bench) rc = regcompile(chunk);
+	if (bench) {
+		err = benchmark(chunk, rc);
 		goto RET;
 	}
-	vm.chunk = chunk;
-	vm.ip = chunk->code;
-	decompile(chunk, "EXECUTING");
-	err = run();
+	if (rc) {
+		rdecompile(rc, "EXECUTING");
+		vmload(chunk);
+		err = rrun(rc);
+	} else if (vm.trace) {
+		decompile(chunk, "EXECUTING");
+		tracechunk(vm.trace, chunk);
+		vmload(chunk);
+		err = run();
+		tracedrain(vm.trace);
+	} else {
+		decompile(chunk, "EXECUTING");
+		err = runchunk(chunk);
+	}
+	if (err == OK) {
+		printf(";; STACK TOP: %s\n", objstr(vm.ret));
+		printf("; TERMINATING\n");
+	}
+	if (quickstats) decompile_quick(chunk);
 RET:
+	rchunkfree(rc);
 	chunkfree(chunk);
 	return err;
 }
 
+#define NGRAM_TOP 10	/* of each length printed */
+#define NGRAM_SUPERS 8	/* SUPERS rows suggested */
+
+typedef struct {
+	uint64_t count;
+	int n;
+	int op[3];
+} NgramRow;
+
+static int
+ngramcmp(const void *a, const void *b)
+{
+	const NgramRow *x = a, *y = b;
+	uint64_t sx = x->count * (x->n - 1), sy = y->count * (y->n - 1);
+	return sx < sy ? 1 : sx > sy ? -1 : y->n - x->n;
+}
+
+/* ops the SUPERS table can be made of */
+static int
+fusablep(int op)
+{
+	return op != OP_RET && op < OP_SUPER_BASE && !OP_QUICKP(op);
+}
+
+/* Most frequent bigrams and trigrams, then SUPERS rows for the ones
+ * that save the most dispatches: a trigram saves two per run, a
+ * bigram one. Profile at -O1 so what's fused already doesn't hide what
+ * it's made of. */
+static void
+ngramprint(Ngram *g)
+{
+	Vec(NgramRow) rows;
+	vec_ini(rows);
+	for (int a = 0; a < OP_COUNT; a++)
+		for (int b = 0; b < OP_COUNT; b++) {
+			NgramRow two = { g->two[a][b], 2, { a, b, OP_NONE } };
+			if (two.count) vec_push(rows, two);
+			for (int c = 0; c < OP_COUNT; c++) {
+				NgramRow three = { g->three[a][b][c], 3, { a, b, c } };
+				if (three.count) vec_push(rows, three);
+			}
+		}
+	qsort(rows, vec_len(rows), sizeof(NgramRow), ngramcmp);
+	for (int n = 2; n <= 3; n++) {
+		for (size_t i = 0, shown = 0; i < vec_len(rows) && shown < NGRAM_TOP; i++) {
+			if (rows[i].n != n) continue;
+			printf(";;; NGRAM %d %12llu", n, (unsigned long long)rows[i].count);
+			for (int j = 0; j < n; j++) printf(" %s", opname(rows[i].op[j]));
+			printf("\n");
+			shown++;
+		}
+	}
+	for (size_t i = 0, shown = 0; i < vec_len(rows) && shown < NGRAM_SUPERS; i++) {
+		NgramRow *r = &rows[i];
+		if (!fusablep(r->op[0]) || !fusablep(r->op[1]) || (r->n == 3 && !fusablep(r->op[2])))
+			continue;
+		printf(";;; SUPER X(%s_%s%s%s, %s, %s, %s)\n",
+		       opname(r->op[0]), opname(r->op[1]), r->n == 3 ? "_" : "",
+		       r->n == 3 ? opname(r->op[2]) : "",
+		       opname(r->op[0]), opname(r->op[1]), r->n == 3 ? opname(r->op[2]) : "NONE");
+		shown++;
+	}
+	vec_free(rows);
+}
+
+static void
+usage(void)
+{
+	exits("usage: %s [-cdgGHmqrs] [-b runs] [-j runs] [-O level] [-p us] [-t tracefile] [file]", argv0);
+}
+
 int main(int argc, char *argv[]) {
-	const char *input = argc > 1 ? argv[1] : NULL;
+	int memstats = 0;
+	int gcstats = 0;
+	long pauseus = 0;	/* -p, see heapincremental */
+	int gcthread = 0;	/* -c */
+	int hashcons = 0;	/* -H, see R_HASHCONS */
+	Pool *module = nil;	/* -s, one pool for every form of the input */
+	const char *tracefile = nil;
+	ARGBEGIN {
+	case 'm': memstats = 1; break;
+	case 'H': hashcons = 1; break;
+	case 'G': gcstats = 1; break;
+	case 'p': pauseus = EARGF2NUM(usage(), 0, LONG_MAX / 1000); break;
+	case 'c': gcthread = 1; break;
+	case 't': tracefile = EARGF(usage()); break;
+	case 'r': regvm = 1; break;
+	case 'b': bench = EARGF2NUM(usage(), 1, LONG_MAX); break;
+	case 'j': jitafter = EARGF2NUM(usage(), 0, LONG_MAX); break;
+	case 'd': jitcheck = 1; break;
+	case 'q': quickstats = 1; break;
+	case 'g': vm.ngram = calloc(1, sizeof(Ngram)); break;
+	case 'O': optlevel = EARGF2NUM(usage(), 0, 2); break;
+	case 's': if (!module) module = poolnew(); break;
+	default: usage();
+	} ARGEND
+	const char *input = argc > 0 ? argv[0] : NULL;
 	Reader *reader = ropen(input);
+	Arena *arena = aspan(4096);	/* reused by every form */
 	Sexp *sexp;
 	int err = 0;
+	if (!reader) return EX_NOINPUT;
+	if (hashcons) rflags(reader, R_HASHCONS);
 	vminit();
+	heapinit(vmroots, HEAP_YOUNG);
+	heapincremental(pauseus, gcthread);
+	if (tracefile && !(vm.trace = traceopen(tracefile))) {
+		eprintf("%s:", tracefile);
+		err = EX_CANTCREAT;
+		goto EXIT;
+	}
 	do {
 		if (!input) printf("> ");
-		sexp = reades(reader);
+		areset(arena);
+		astatclear(arena);
+		sexp = readesa(reader, arena);
 		if (readerr(reader)) {
 			fprintf(stderr, "%ld: %s\n", readerrat(reader), readerr(reader));
 			err = EX_DATAERR;
 			goto EXIT;
 		}
-#ifdef VM_TRACE
-		printf(";;; INPUT BEG\n");
-		printes(sexp);
-		printf("\n;;; INPUT END\n");
-#endif
+		if (vm.trace) {
+			printf(";;; INPUT BEG\n");
+			printes(sexp);
+			printf("\n;;; INPUT END\n");
+		}
 		fflush(stdout);
-		switch (eval(sexp)) {
+		switch (eval(sexp, module)) {
 		case COMPILE_ERR: err = EX_DATAERR;  goto EXIT; break;
 		case RUNTIME_ERR: err = EX_SOFTWARE; goto EXIT; break;
 		case OK: break;
 		}
-		sexpfree(sexp);
+		if (memstats) aprintstats(arena, stdout);
 	} while (!readeof(reader));
 EXIT:
-	sexpfree(sexp);
+	traceclose(vm.trace);
+	if (vm.ngram) ngramprint(vm.ngram);
+	if (gcstats) heapstats(stdout);
+	free(vm.ngram);
+	poolfree(module);
+	deinit(arena);
 	rclose(reader);
 	vmfree();
+	heapfree();
 	return err;
 }
@@ -0,0 +1,623 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "aux.h"
+#include "sym.h"
+#include "types/value.h"
+#include "types/vec.h"
+#include "heap.h"
+
+#define HEAP_BLOCK (1 << 18)	/* old generation blocks, bigger objects get their own */
+#define HEAP_SMALL 512		/* exact size free lists up to here */
+#define HEAP_OLD_MIN (4 << 20)	/* old bytes before the first major collection */
+#define HEAP_SLICE (64 << 10)	/* young bytes allocated between slices, at most */
+#define HEAP_YOUNG_MIN (16 << 10)	/* the young generation doesn't shrink past */
+#define HEAP_CHECK 256		/* objects marked between looks at the clock */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/* old objects are bumped into blocks, a freed run of them is an
+ * OBJ_FREE object on a free list, or too small for one and only
+ * skipped over */
+typedef struct Block {
+	struct Block *next;
+	size_t siz;		/* bytes for objects */
+	size_t used;		/* bumped so far */
+	size_t swept;		/* the cycle that last swept it */
+	char mem[];
+} Block;
+
+typedef struct Free {
+	Obj obj;
+	struct Free *next;
+} Free;
+
+/* what's left of a young object copied out */
+typedef struct {
+	Obj obj;
+	Obj *to;
+} Fwd;
+
+typedef enum {
+	HEAP_IDLE,
+	HEAP_MARK,
+	HEAP_SWEEP,
+} HeapPhase;
+
+static struct {
+	HeapRoots roots;
+	char *young;		/* young generation, bumped from `cur' */
+	char *cur;
+	char *limit;		/* `top', or where the next slice is due */
+	char *top;		/* what's used of it, see youngresize */
+	char *end;
+	Block *blocks;		/* old generation, bumping into the first */
+	Free *free[HEAP_SMALL / 8 + 1];	/* by size */
+	Free *large;		/* bigger than HEAP_SMALL, first fit */
+	size_t old;		/* bytes in old objects */
+	size_t nblocks;
+	size_t nextmajor;	/* start a cycle past this */
+	Vec(Obj *) work;	/* copied objects to scan */
+	Vec(Obj *) remembered;	/* old objects heapset stored young ones into */
+	HeapPhase phase;
+	uint8_t epoch;		/* Obj.mark of what this cycle marked */
+	Vec(Obj *) grey;	/* marked pairs whose fields aren't yet */
+	Block **sweep;		/* next block the sweep looks at */
+	uint64_t budget;	/* ns a slice may take, 0 collects all at once */
+	/* With a marker thread `grey' is all its own. The write barrier
+	 * logs what it overwrites for the marker to grey, and the VM only
+	 * looks at `markdone' until it's set. */
+	int thread;
+	int marking;		/* the marker runs */
+	pthread_t marker;
+	pthread_mutex_t lock;	/* of `logged' */
+	Vec(Value) logged;
+	atomic_int markdone;
+	HeapPauses minor;	/* minor collections, and the snapshots */
+	HeapPauses slice;
+	HeapPauses major;	/* whole cycles at once */
+} heap;
+
+static uint64_t
+nsnow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+logpause(HeapPauses *p, uint64_t ns)
+{
+	int i = 0;
+	for (uint64_t us = ns / 1000; us && i < HEAP_PAUSES - 1; us >>= 1) i++;
+	p->hist[i]++;
+	p->count++;
+	p->total += ns;
+	p->max = max(p->max, ns);
+	vec_push(p->ns, ns);
+}
+
+/* `list' is 0 for a run in a block the sweep has yet to get to, it
+ * would list it a second time */
+static void
+freechunk(char *p, size_t size, int list)
+{
+	Free *f = (Free *)p;
+	if (!size) return;
+	f->obj = (Obj){ .type = OBJ_FREE, .size = size };
+	if (size < sizeof(Free) || !list) return;
+	if (size <= HEAP_SMALL) {
+		f->next = heap.free[size / 8];
+		heap.free[size / 8] = f;
+	} else {
+		f->next = heap.large;
+		heap.large = f;
+	}
+}
+
+/* first fit from the large list, what's left over goes back */
+static Obj *
+largefit(size_t size)
+{
+	for (Free **fp = &heap.large; *fp; fp = &(*fp)->next) {
+		Free *f = *fp;
+		size_t rest = f->obj.size - size;
+		if (f->obj.size < size) continue;
+		*fp = f->next;
+		if (rest < sizeof(Free)) size = f->obj.size;
+		else freechunk((char *)f + size, rest, 1);
+		f->obj.size = size;
+		return &f->obj;
+	}
+	return nil;
+}
+
+static Obj *
+bump(size_t size)
+{
+	Block *b = heap.blocks;
+	if (!b || b->siz - b->used < size) {
+		if (b) {
+			freechunk(b->mem + b->used, b->siz - b->used,
+				  heap.phase != HEAP_SWEEP || b->swept == heap.epoch);
+			b->used = b->siz;
+		}
+		size_t siz = max(HEAP_BLOCK, size);
+		if (!(b = malloc(sizeof(Block) + siz))) exits("heap");
+		b->siz = siz;
+		b->used = 0;
+		b->swept = heap.epoch;	/* nothing in it to sweep this cycle */
+		b->next = heap.blocks;
+		heap.blocks = b;
+		heap.nblocks++;
+	}
+	Obj *obj = (Obj *)(b->mem + b->used);
+	obj->size = size;
+	b->used += size;
+	return obj;
+}
+
+/* Made marked, a cycle going on doesn't look at it and the next one
+ * starts with a new epoch. */
+static Obj *
+oldalloc(size_t size)
+{
+	Obj *obj = nil;
+	if (size <= HEAP_SMALL && heap.free[size / 8]) {
+		Free *f = heap.free[size / 8];
+		heap.free[size / 8] = f->next;
+		obj = &f->obj;
+	} else if (size > HEAP_SMALL) {
+		obj = largefit(size);
+	}
+	if (!obj) obj = bump(size);
+	obj->flags = 0;
+	obj->mark = heap.epoch;
+	heap.old += obj->size;
+	return obj;
+}
+
+#define YOUNGP(p) ((char *)(p) >= heap.young && (char *)(p) < heap.end)
+
+static void
+evacuate(Value *val)
+{
+	Value v = *val;
+	if (!OBJP(v) || !YOUNGP(AS_PTR(v))) return;
+	Obj *obj = AS_OBJ(v);
+	if (!(obj->flags & OBJ_FWD)) {
+		Obj *to = oldalloc(obj->size);
+		size_t size = to->size;
+		memcpy(to, obj, obj->size);
+		to->size = size;
+		to->flags = 0;
+		to->mark = heap.epoch;
+		obj->flags |= OBJ_FWD;
+		((Fwd *)obj)->to = to;
+		vec_push(heap.work, to);
+	}
+	*val = TO_OBJ(((Fwd *)obj)->to);
+}
+
+/* everything young that's reachable goes old */
+static void
+minor(void)
+{
+	heap.roots(evacuate);
+	for (size_t i = 0; i < vec_len(heap.remembered); i++) {
+		Pair *p = (Pair *)heap.remembered[i];
+		p->obj.flags &= ~OBJ_REMEMBERED;
+		evacuate(&p->car);
+		evacuate(&p->cdr);
+	}
+	vecptr(heap.remembered)->len = 0;
+	while (vec_len(heap.work)) {
+		Pair *p = (Pair *)vec_pop(heap.work);
+		if (p->obj.type != OBJ_PAIR) continue;
+		evacuate(&p->car);
+		evacuate(&p->cdr);
+	}
+	heap.cur = heap.young;
+}
+
+/* Marks an old object and greys it if it has fields. Young ones are
+ * left alone, they're marked when they're made old. Both the marker
+ * thread and the VM call this, but never at the same time. */
+static void
+shade(Value val)
+{
+	if (!OBJP(val) || YOUNGP(AS_PTR(val))) return;
+	Obj *obj = AS_OBJ(val);
+	if (obj->mark == heap.epoch) return;
+	obj->mark = heap.epoch;
+	if (obj->type == OBJ_PAIR) vec_push(heap.grey, obj);
+}
+
+static void
+shaderoot(Value *val)
+{
+	shade(*val);
+}
+
+/* marks until there's nothing grey or past `deadline', 0 for never,
+ * returns 1 when it's done */
+static int
+markstep(uint64_t deadline)
+{
+	for (size_t n = 1; vec_len(heap.grey); n++) {
+		Pair *p = (Pair *)vec_pop(heap.grey);
+		/* with a marker thread these race with heapset, an aligned
+		 * Value is read whole and either one is fine */
+		shade(p->car);
+		shade(p->cdr);
+		if (deadline && n % HEAP_CHECK == 0 && nsnow() >= deadline) break;
+	}
+	return !vec_len(heap.grey);
+}
+
+static void *
+marker(void *arg)
+{
+	USED(arg);
+	do {
+		markstep(0);
+		pthread_mutex_lock(&heap.lock);
+		while (vec_len(heap.logged)) shade(vec_pop(heap.logged));
+		pthread_mutex_unlock(&heap.lock);
+	} while (vec_len(heap.grey));
+	atomic_store(&heap.markdone, 1);
+	return nil;
+}
+
+/* Right after a minor collection, nothing is young. A new epoch makes
+ * every old object white, the roots are greyed and that's the snapshot. */
+static void
+cyclebegin(void)
+{
+	heap.epoch++;
+	heap.phase = HEAP_MARK;
+	heap.roots(shaderoot);
+	if (!heap.thread) return;
+	atomic_store(&heap.markdone, 0);
+	heap.marking = 1;
+	if (pthread_create(&heap.marker, nil, marker, nil)) {
+		heap.marking = 0;	/* the slices mark then */
+		return;
+	}
+}
+
+/* waits for the marker and greys what the barrier logged after it
+ * last looked */
+static void
+markerjoin(void)
+{
+	if (!heap.marking) return;
+	pthread_join(heap.marker, nil);
+	heap.marking = 0;
+	while (vec_len(heap.logged)) shade(vec_pop(heap.logged));
+}
+
+static void
+sweepbegin(void)
+{
+	memset(heap.free, 0, sizeof(heap.free));
+	heap.large = nil;
+	heap.sweep = &heap.blocks;
+	heap.phase = HEAP_SWEEP;
+}
+
+/* Walks one block, runs of dead objects become one free chunk. A
+ * block with nothing alive goes back to malloc, unless it's the one
+ * being bumped into. */
+static void
+sweepblock(void)
+{
+	Block *b = *heap.sweep;
+	char *p = b->mem, *end = b->mem + b->used, *run = nil;
+	size_t live = 0;
+	for (Obj *o; p < end; p += o->size) {
+		o = (Obj *)p;
+		if (o->type != OBJ_FREE && o->mark == heap.epoch) {
+			if (run) freechunk(run, p - run, 1);
+			run = nil;
+			live += o->size;
+		} else {
+			if (o->type != OBJ_FREE) heap.old -= o->size;
+			if (!run) run = p;
+		}
+	}
+	b->swept = heap.epoch;
+	if (!live && b != heap.blocks) {
+		*heap.sweep = b->next;
+		free(b);
+		heap.nblocks--;
+		return;
+	}
+	if (run && b == heap.blocks) b->used = run - b->mem;
+	else if (run) freechunk(run, end - run, 1);
+	heap.sweep = &b->next;
+}
+
+/* sweeps until every block is or past `deadline', returns 1 when done */
+static int
+sweepstep(uint64_t deadline)
+{
+	for (int n = 0; *heap.sweep; n++) {
+		if (deadline && n && nsnow() >= deadline) return 0;
+		if ((*heap.sweep)->swept == heap.epoch) heap.sweep = &(*heap.sweep)->next;
+		else sweepblock();
+	}
+	heap.phase = HEAP_IDLE;
+	heap.nextmajor = max(HEAP_OLD_MIN, 2 * heap.old);
+	return 1;
+}
+
+/* the rest of the cycle going on, all at once */
+static void
+cycleend(void)
+{
+	markerjoin();
+	if (heap.phase == HEAP_MARK) {
+		markstep(0);
+		sweepbegin();
+	}
+	sweepstep(0);
+}
+
+/* one bounded step of the cycle going on, between allocations */
+static void
+slice(void)
+{
+	uint64_t t = nsnow(), deadline = t + heap.budget;
+	if (heap.phase == HEAP_MARK && heap.marking) {
+		if (!atomic_load(&heap.markdone)) return;
+		markerjoin();
+	}
+	if (heap.phase == HEAP_MARK && markstep(deadline)) sweepbegin();
+	if (heap.phase == HEAP_SWEEP && nsnow() < deadline) sweepstep(deadline);
+	logpause(&heap.slice, nsnow() - t);
+}
+
+/* With a budget the young generation shrinks or grows towards what a
+ * minor collection gets through in it, by half or double at most. */
+static void
+youngresize(size_t used, uint64_t ns)
+{
+	size_t cur = heap.top - heap.young, want;
+	if (!ns || used < cur / 2) return;	/* collected early, says little */
+	want = heap.budget * used / ns;
+	want = min(max(want, cur / 2), cur * 2);
+	want = min(max(want, HEAP_YOUNG_MIN), (size_t)(heap.end - heap.young));
+	heap.top = heap.young + ALIGN8(want);
+}
+
+void
+heapcollect(int full)
+{
+	uint64_t t = nsnow();
+	size_t used = heap.cur - heap.young;
+	HeapPauses *kind = &heap.minor;
+	minor();
+	/* the program made garbage faster than the slices took it */
+	if (heap.phase != HEAP_IDLE && (full || heap.old > 2 * heap.nextmajor)) {
+		cycleend();
+		kind = &heap.major;
+	}
+	if (heap.phase == HEAP_IDLE && (full || heap.old > heap.nextmajor)) {
+		cyclebegin();
+		if (full || !heap.budget) {
+			cycleend();
+			kind = &heap.major;
+		}
+	}
+	t = nsnow() - t;
+	logpause(kind, t);
+	if (heap.budget && kind == &heap.minor) youngresize(used, t);
+}
+
+void
+heapinit(HeapRoots roots, size_t young)
+{
+	young = ALIGN8(max(young, 4096));
+	heap.roots = roots;
+	if (!(heap.young = malloc(young))) exits("heap");
+	heap.cur = heap.young;
+	heap.end = heap.top = heap.limit = heap.young + young;
+	heap.nextmajor = HEAP_OLD_MIN;
+	heap.epoch = 1;
+	vec_ini(heap.work);
+	vec_ini(heap.remembered);
+	vec_ini(heap.grey);
+	vec_ini(heap.logged);
+	vec_ini(heap.minor.ns);
+	vec_ini(heap.slice.ns);
+	vec_ini(heap.major.ns);
+	pthread_mutex_init(&heap.lock, nil);
+}
+
+void
+heapincremental(long us, int thread)
+{
+	heap.thread = thread;
+	heap.budget = (thread && !us ? HEAP_BUDGET : us) * 1000ull;
+}
+
+void
+heapfree(void)
+{
+	markerjoin();
+	free(heap.young);
+	while (heap.blocks) {
+		Block *b = heap.blocks;
+		heap.blocks = b->next;
+		free(b);
+	}
+	vec_free(heap.work);
+	vec_free(heap.remembered);
+	vec_free(heap.grey);
+	vec_free(heap.logged);
+	vec_free(heap.minor.ns);
+	vec_free(heap.slice.ns);
+	vec_free(heap.major.ns);
+	pthread_mutex_destroy(&heap.lock);
+	memset(&heap, 0, sizeof(heap));
+}
+
+/* the young generation is full, or a slice is due */
+static void
+youngfull(size_t size)
+{
+	if (heap.limit < heap.top && (size_t)(heap.top - heap.cur) >= size) slice();
+	else heapcollect(0);
+	size_t every = min(HEAP_SLICE, (size_t)(heap.top - heap.young) / 4);
+	heap.limit = heap.top;
+	if (heap.phase != HEAP_IDLE && (size_t)(heap.top - heap.cur) > every)
+		heap.limit = heap.cur + every;
+}
+
+static Obj *
+youngalloc(size_t size)
+{
+	Obj *obj;
+	if ((size_t)(heap.limit - heap.cur) < size) {
+		/* too big to ever fit, it can only be a string */
+		if (size > (size_t)(heap.end - heap.young) / 2) {
+			if (heap.old + size > heap.nextmajor) heapcollect(0);
+			return oldalloc(size);
+		}
+		youngfull(size);
+	}
+	obj = (Obj *)heap.cur;
+	heap.cur += size;
+	obj->size = size;
+	obj->flags = 0;
+	return obj;
+}
+
+Pair *
+heappair(void)
+{
+	Pair *p = (Pair *)youngalloc(sizeof(Pair));
+	p->obj.type = OBJ_PAIR;
+	return p;
+}
+
+Str *
+heapstr(size_t len)
+{
+	Str *s = (Str *)youngalloc(ALIGN8(sizeof(Str) + len + 1));
+	s->obj.type = OBJ_STR;
+	s->len = len;
+	return s;
+}
+
+void
+heapset(Obj *obj, Value *field, Value val)
+{
+	Value old = *field;
+	/* keep the snapshot: what's overwritten was reachable in it */
+	if (heap.phase == HEAP_MARK && OBJP(old) && !YOUNGP(AS_PTR(old))) {
+		if (heap.marking) {
+			pthread_mutex_lock(&heap.lock);
+			vec_push(heap.logged, old);
+			pthread_mutex_unlock(&heap.lock);
+		} else {
+			shade(old);
+		}
+	}
+	if (OBJP(val) && YOUNGP(AS_PTR(val)) && !YOUNGP(obj) && !(obj->flags & OBJ_REMEMBERED)) {
+		obj->flags |= OBJ_REMEMBERED;
+		vec_push(heap.remembered, obj);
+	}
+	*field = val;
+}
+
+static int
+nscmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+statpauses(FILE *out, const char *name, HeapPauses *p)
+{
+	double p99 = 0;
+	if (p->count) {
+		qsort(p->ns, p->count, sizeof(uint64_t), nscmp);
+		p99 = p->ns[(p->count * 99 + 99) / 100 - 1] / 1e3;
+	}
+	fprintf(out, ";;; GC %-5s %8zu PAUSES %10.1f US TOTAL %10.1f US MAX %10.1f US P99\n",
+		name, p->count, p->total / 1e3, p->max / 1e3, p99);
+	for (int i = 0; i < HEAP_PAUSES; i++) {
+		if (!p->hist[i]) continue;
+		fprintf(out, ";;; GC %-5s < %8llu US %8zu\n", name, 1ull << i, p->hist[i]);
+	}
+}
+
+void
+heapstats(FILE *out)
+{
+	HeapPauses all = { 0 };
+	HeapPauses *kinds[] = { &heap.minor, &heap.slice, &heap.major };
+	vec_ini(all.ns);
+	for (size_t i = 0; i < nelem(kinds); i++)
+		for (size_t j = 0; j < kinds[i]->count; j++) logpause(&all, kinds[i]->ns[j]);
+	fprintf(out, ";;; GC YOUNG %zu/%zu BYTES, OLD %zu BYTES IN %zu BLOCKS\n",
+		(size_t)(heap.top - heap.young), (size_t)(heap.end - heap.young),
+		heap.old, heap.nblocks);
+	statpauses(out, "MINOR", &heap.minor);
+	statpauses(out, "SLICE", &heap.slice);
+	statpauses(out, "MAJOR", &heap.major);
+	statpauses(out, "ALL", &all);
+	vec_free(all.ns);
+}
+
+/* print into what's left of [*p, end), stops quietly once it's full */
+static void
+outf(char **p, char *end, const char *fmt, ...)
+{
+	va_list ap;
+	if (*p >= end) return;
+	va_start(ap, fmt);
+	int n = vsnprintf(*p, end - *p, fmt, ap);
+	va_end(ap);
+	*p = n < 0 ? end : min(*p + n, end);
+}
+
+#define OBJSTR_DEPTH 64	/* nested lists printed, deeper ones are ... */
+
+static void
+objstr_(char **p, char *end, Value val, int depth)
+{
+	if (HSTRP(val)) {
+		outf(p, end, "\"%s\"", AS_HSTR(val)->str);
+	} else if (PAIRP(val) && depth >= OBJSTR_DEPTH) {
+		outf(p, end, "(...)");
+	} else if (PAIRP(val)) {
+		outf(p, end, "(");
+		for (;;) {
+			objstr_(p, end, AS_PAIR(val)->car, depth + 1);
+			val = AS_PAIR(val)->cdr;
+			if (!PAIRP(val) || *p >= end) break;
+			outf(p, end, " ");
+		}
+		if (!NILP(val)) {
+			outf(p, end, " . ");
+			objstr_(p, end, val, depth + 1);
+		}
+		outf(p, end, ")");
+	} else {
+		outf(p, end, "%s", valuestr(val));
+	}
+}
+
+const char *
+objstr(Value val)
+{
+	static char buff[BUFSIZ];
+	char *p = buff;
+	objstr_(&p, buff + sizeof(buff), val, 0);
+	if (p == buff + sizeof(buff)) strcpy(buff + sizeof(buff) - 4, "...");
+	return buff;
+}
@@ -0,0 +1,96 @@
+/* managed heap for OBJ_MASK values */
+/*
+#include "aux.h"
+#include "types/value.h"
+#include "types/vec.h"
+*/
+
+/* Objects are first bumped into the young generation. A minor
+ * collection copies what survives it into the old generation, which is
+ * mark-swept once it has grown enough since the last time.
+ *
+ * Old objects only point at young ones after heapset stored one there,
+ * it remembers the object for the next minor collection to scan along
+ * with the roots.
+ *
+ * The old generation is marked from a snapshot of the roots taken right
+ * after a minor collection, so nothing young is in it. With a pause
+ * budget the marking and the sweep after it are done in slices between
+ * allocations, or the marking on a thread of its own. heapset greys
+ * the value it overwrites while marking, and objects made old are
+ * marked already, so everything that was reachable at the snapshot
+ * still gets marked. */
+
+typedef enum {
+	OBJ_PAIR,
+	OBJ_STR,
+	OBJ_FREE,	/* unused old memory, for the sweep to walk over */
+} ObjType;
+
+enum {
+	OBJ_FWD = 1 << 0,	/* young object copied out, see Fwd */
+	OBJ_REMEMBERED = 1 << 1,	/* old object in the remembered set */
+};
+
+typedef struct {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t mark;		/* the cycle that marked it, a byte of its own
+				 * so the marker thread is its only writer */
+	uint8_t pad_;
+	uint32_t size;		/* bytes with the header, a multiple of 8 */
+} Obj;
+
+typedef struct {
+	Obj obj;
+	Value car;
+	Value cdr;
+} Pair;
+
+typedef struct {
+	Obj obj;
+	uint32_t len;
+	char str[];		/* NUL terminated */
+} Str;
+
+#define TO_OBJ(p)  ((Value){ .as_uint = (uint64_t)(p) | OBJ_MASK })
+#define AS_OBJ(v)  ((Obj *)AS_PTR(v))
+#define AS_PAIR(v) ((Pair *)AS_PTR(v))
+#define AS_HSTR(v) ((Str *)AS_PTR(v))
+#define PAIRP(v)   (OBJP(v) && AS_OBJ(v)->type == OBJ_PAIR)
+#define HSTRP(v)   (OBJP(v) && AS_OBJ(v)->type == OBJ_STR)
+#define NILP(v)    ((v).as_uint == NULL_VALUE)
+#define NIL        ((Value){ .as_uint = NULL_VALUE })
+
+/* `visit' gets every root and may change it to where its object moved */
+typedef void (*HeapVisit)(Value *val);
+typedef void (*HeapRoots)(HeapVisit visit);
+
+#define HEAP_YOUNG (1 << 20)	/* default young generation bytes */
+#define HEAP_BUDGET 500		/* default slice us with a marker thread */
+#define HEAP_PAUSES 24		/* histogram buckets, see HeapPauses */
+
+typedef struct {
+	size_t count;
+	uint64_t total;		/* ns */
+	uint64_t max;
+	size_t hist[HEAP_PAUSES];	/* [0] under 1 us, [i] under 2^i us */
+	Vec(uint64_t) ns;	/* every pause, for the percentiles */
+} HeapPauses;
+
+void heapinit(HeapRoots roots, size_t young);
+/* Collect the old generation in slices of at most `us' microseconds, 0
+ * for all at once. `thread' marks on a thread of its own and leaves
+ * only the sweep to the slices. */
+void heapincremental(long us, int thread);
+void heapfree(void);
+/* These may collect, which moves young objects. Keep the Values going
+ * into the new object on the roots until it's filled in. */
+Pair *heappair(void);
+Str *heapstr(size_t len);
+/* stores `val' into `field' of `obj', the write barrier */
+void heapset(Obj *obj, Value *field, Value val);
+void heapcollect(int major);
+void heapstats(FILE *out);
+/* valuestr that also prints lists and heap strings */
+const char *objstr(Value val);
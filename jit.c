@@ -0,0 +1,243 @@
+#include <sys/mman.h>
+#include "aux.h"
+#include "sym.h"
+#include "types/value.h"
+#include "types/arena.h"
+#include "types/sexp.h"
+#include "types/vec.h"
+#include "types/ht.h"
+#include "compi.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+/* Register use in the generated code, all callee saved so the slow
+ * path can call into C without spilling:
+ *	rbx	stack pointer (vm.sp)
+ *	r12	frame base (vm.bsp), lexical slots
+ *	r13	conspool
+ * rax, rcx and rdx are scratch. The prologue pushes three registers,
+ * which leaves rsp 16 byte aligned for calls. */
+
+/* `code' is a Vec(uint8_t) *, pushing can move the vector */
+#define B(...) do {							\
+		uint8_t b_[] = { __VA_ARGS__ };				\
+		for (size_t i_ = 0; i_ < sizeof(b_); i_++)		\
+			vec_push((*code), b_[i_]);			\
+	} while (0)
+
+static void
+imm32(Vec(uint8_t) *code, uint32_t u)
+{
+	for (int i = 0; i < 4; i++) vec_push((*code), (uint8_t)(u >> 8 * i));
+}
+
+static void
+imm64(Vec(uint8_t) *code, uint64_t u)
+{
+	for (int i = 0; i < 8; i++) vec_push((*code), (uint8_t)(u >> 8 * i));
+}
+
+static size_t
+arg(Chunk *chunk, size_t *ip)
+{
+	size_t len, arg = uleb(chunk->code + *ip, &len);
+	*ip += len;
+	return arg;
+}
+
+/* index * sizeof(Value) as a disp32, 0 if it doesn't fit */
+static int
+disp(Vec(uint8_t) *code, size_t idx)
+{
+	if (idx > INT32_MAX / sizeof(Value)) return 0;
+	imm32(code, idx * sizeof(Value));
+	return 1;
+}
+
+static void
+patch32(Vec(uint8_t) *code, size_t at, size_t to)
+{
+	uint32_t rel = to - (at + 4);
+	for (int i = 0; i < 4; i++) (*code)[at + i] = rel >> 8 * i;
+}
+
+/* jne to a slow path if rax (or rcx) isn't an int, returns where the
+ * jump offset goes */
+static size_t
+intguard(Vec(uint8_t) *code, int rcx)
+{
+	if (rcx) B(0x48, 0x89, 0xca);	/* mov rdx, rcx */
+	else     B(0x48, 0x89, 0xc2);	/* mov rdx, rax */
+	B(0x48, 0xc1, 0xea, 0x30);	/* shr rdx, 48 */
+	B(0x81, 0xfa);			/* cmp edx, INT_MASK >> 48 */
+	imm32(code, INT_MASK >> 48);
+	B(0x0f, 0x85);			/* jne slow */
+	imm32(code, 0);
+	return vec_len(*code) - 4;
+}
+
+/* box the int32 in eax the way TO_INT does */
+static void
+boxint(Vec(uint8_t) *code)
+{
+	B(0x48, 0x63, 0xc0);		/* movsxd rax, eax */
+	B(0x48, 0xc1, 0xe0, 0x10);	/* shl rax, 16 */
+	B(0x48, 0xc1, 0xe8, 0x10);	/* shr rax, 16 */
+	B(0x48, 0xba);			/* mov rdx, INT_MASK */
+	imm64(code, INT_MASK);
+	B(0x48, 0x09, 0xd0);		/* or rax, rdx */
+}
+
+static void
+slowcall(Vec(uint8_t) *code, JitSlow slow, int op, Value k)
+{
+	B(0x48, 0x89, 0xdf);		/* mov rdi, rbx */
+	B(0xbe);			/* mov esi, op */
+	imm32(code, op);
+	B(0x48, 0xba);			/* mov rdx, k */
+	imm64(code, k.as_uint);
+	B(0x48, 0xb8);			/* mov rax, slow */
+	imm64(code, (uint64_t)(uintptr_t)slow);
+	B(0xff, 0xd0);			/* call rax */
+	B(0x48, 0x89, 0xc3);		/* mov rbx, rax */
+}
+
+/* NEG, ADD, SUB and MUL of ints inline, anything else through `slow' */
+static void
+arith(Vec(uint8_t) *code, JitSlow slow, int op)
+{
+	size_t guards[2], ng = 0, done;
+	if (op == OP_NEG) {
+		B(0x48, 0x8b, 0x43, 0xf8);	/* mov rax, [rbx-8] */
+		guards[ng++] = intguard(code, 0);
+		B(0xf7, 0xd8);			/* neg eax */
+		boxint(code);
+		B(0x48, 0x89, 0x43, 0xf8);	/* mov [rbx-8], rax */
+	} else {
+		B(0x48, 0x8b, 0x43, 0xf0);	/* mov rax, [rbx-16] */
+		B(0x48, 0x8b, 0x4b, 0xf8);	/* mov rcx, [rbx-8] */
+		guards[ng++] = intguard(code, 0);
+		guards[ng++] = intguard(code, 1);
+		switch (op) {
+		case OP_ADD: B(0x01, 0xc8); break;		/* add eax, ecx */
+		case OP_SUB: B(0x29, 0xc8); break;		/* sub eax, ecx */
+		case OP_MUL: B(0x0f, 0xaf, 0xc1); break;	/* imul eax, ecx */
+		}
+		boxint(code);
+		B(0x48, 0x89, 0x43, 0xf0);	/* mov [rbx-16], rax */
+		B(0x48, 0x83, 0xeb, 0x08);	/* sub rbx, 8 */
+	}
+	B(0xe9);				/* jmp done */
+	imm32(code, 0);
+	done = vec_len(*code) - 4;
+	for (size_t i = 0; i < ng; i++) patch32(code, guards[i], vec_len(*code));
+	slowcall(code, slow, op, TO_INT(0));
+	patch32(code, done, vec_len(*code));
+}
+
+Jit *
+jitcompile(Chunk *chunk, JitSlow slow)
+{
+	Vec(uint8_t) buf;
+	Vec(uint8_t) *code = &buf;
+	uint8_t op = OP_RET;
+	vec_ini(buf);
+	B(0x53);			/* push rbx */
+	B(0x41, 0x54);			/* push r12 */
+	B(0x41, 0x55);			/* push r13 */
+	B(0x49, 0x89, 0xfc);		/* mov r12, rdi */
+	B(0x48, 0x89, 0xf3);		/* mov rbx, rsi */
+	B(0x49, 0x89, 0xd5);		/* mov r13, rdx */
+	uint8_t parts[SUPER_MAX];
+	int nparts = 0, part = 0;
+	/* a superinstruction gets the templates of its parts */
+	for (size_t ip = 0; ip < vec_len(chunk->code) || part < nparts;) {
+		if (part == nparts) {
+			nparts = superparts(chunk->code[ip++], parts);
+			part = 0;
+		}
+		switch (op = parts[part++]) {
+		case OP_CONS:
+			B(0x49, 0x8b, 0x85);		/* mov rax, [r13+k*8] */
+			if (!disp(code, arg(chunk, &ip))) goto BAIL;
+			B(0x48, 0x89, 0x03);		/* mov [rbx], rax */
+			B(0x48, 0x83, 0xc3, 0x08);	/* add rbx, 8 */
+			break;
+		case OP_LOAD_LEX:
+			B(0x49, 0x8b, 0x84, 0x24);	/* mov rax, [r12+slot*8] */
+			if (!disp(code, arg(chunk, &ip))) goto BAIL;
+			B(0x48, 0x89, 0x03);		/* mov [rbx], rax */
+			B(0x48, 0x83, 0xc3, 0x08);	/* add rbx, 8 */
+			break;
+		case OP_BIND_LEX:
+			B(0x48, 0x83, 0xeb, 0x08);	/* sub rbx, 8 */
+			B(0x48, 0x8b, 0x03);		/* mov rax, [rbx] */
+			B(0x49, 0x89, 0x84, 0x24);	/* mov [r12+slot*8], rax */
+			if (!disp(code, arg(chunk, &ip))) goto BAIL;
+			break;
+		case OP_TEE_LEX:
+			B(0x48, 0x8b, 0x43, 0xf8);	/* mov rax, [rbx-8] */
+			B(0x49, 0x89, 0x84, 0x24);	/* mov [r12+slot*8], rax */
+			if (!disp(code, arg(chunk, &ip))) goto BAIL;
+			break;
+		case OP_BIND_DYN:
+		case OP_LOAD_DYN:
+			slowcall(code, slow, op, chunk->pool->vals[arg(chunk, &ip)]);
+			break;
+		case OP_NEG: case OP_ADD: case OP_SUB: case OP_MUL:
+			arith(code, slow, op);
+			break;
+		case OP_DIV:	/* jitslow() checks the divisor */
+			slowcall(code, slow, op, TO_INT(0));
+			break;
+		case OP_RET:
+			B(0x48, 0x89, 0xd8);		/* mov rax, rbx */
+			B(0x41, 0x5d);			/* pop r13 */
+			B(0x41, 0x5c);			/* pop r12 */
+			B(0x5b);			/* pop rbx */
+			B(0xc3);			/* ret */
+			break;
+		default:
+			goto BAIL;
+		}
+	}
+	if (op != OP_RET) goto BAIL;	/* would run off the end */
+	Jit *jit = malloc(sizeof(Jit));
+	jit->siz = vec_len(buf);
+	jit->mem = mmap(nil, jit->siz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->mem == MAP_FAILED) goto FAIL;
+	memcpy(jit->mem, buf, jit->siz);
+	if (mprotect(jit->mem, jit->siz, PROT_READ | PROT_EXEC) < 0) {
+		munmap(jit->mem, jit->siz);
+		goto FAIL;
+	}
+	vec_free(buf);
+	jit->fn = (JitFn)(uintptr_t)jit->mem;
+	return jit;
+FAIL:
+	free(jit);
+BAIL:
+	vec_free(buf);
+	return nil;
+}
+
+#else
+
+Jit *
+jitcompile(Chunk *chunk, JitSlow slow)
+{
+	USED(chunk);
+	USED(slow);
+	return nil;
+}
+
+#endif
+
+void
+jitfree(Jit *jit)
+{
+	if (!jit) return;
+	munmap(jit->mem, jit->siz);
+	free(jit);
+}
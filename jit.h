@@ -0,0 +1,22 @@
+/* baseline JIT: one x86-64 machine code template per OpCode */
+/*
+#include "types/value.h"
+#include "compi.h"
+*/
+
+/* The compiled chunk runs on the VM stack with the same Value layout
+ * as run(), it returns the stack pointer after RET's operand. */
+typedef Value *(*JitFn)(Value *bsp, Value *sp, Value *cons);
+/* what the templates leave to C: does `op' with constant `k' to the
+ * stack at `sp' as run() would and returns the new stack pointer */
+typedef Value *(*JitSlow)(Value *sp, int op, Value k);
+
+struct Jit {
+	void *mem;		/* mmaped, executable once compiled */
+	size_t siz;
+	JitFn fn;
+};
+
+/* nil if the chunk has an opcode without a template or this isn't x86-64 */
+Jit *jitcompile(Chunk *chunk, JitSlow slow);
+void jitfree(Jit *jit);
@@ -1,9 +1,15 @@
 /*;; The Sexp Reader For More Civilized Age ;;*/
 /* todo: add macro suppprt */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "aux.h"
-#include "types/vec.h"
 #include "types/arena.h"
 #include "types/sexp.h"
+#include "types/vec.h"
+#include "types/ht.h"
+#include "scan.h"
+#include "sym.h"
 #include "read.h"
 
 
@@ -20,6 +26,7 @@ typedef struct {
 		UNMATCHED_KET_ERR,
 		UNMATCHED_SBRA_ERR,
 		UNMATCHED_SKET_ERR,
+		TOKEN_ERR,
 	} type;
 	size_t at;
 } ReadErr;
@@ -36,6 +43,7 @@ const char *READ_ERR[] = {
 	[UNMATCHED_KET_ERR]      = "unmatched close parenthesis",
 	[UNMATCHED_SBRA_ERR]     = "unmatched opening square bracket",
 	[UNMATCHED_SKET_ERR]     = "unmatched close square bracket",
+	[TOKEN_ERR]              = "[, ', ` and # are not supported",
 };
 
 /* 'nextitem` either returns token from this enum or Cell pointer
@@ -56,13 +64,55 @@ typedef enum {
 
 
 /* ;; TOKENIZER ;; */
+/* The input is scanned through a contiguous window `buf'. Regular files
+ * are mmaped whole, anything else (pipes, ttys) is read into an owned
+ * buffer which keeps only the input from `tok' on, so the window holds at
+ * most the token being read plus one read(2) worth of input. */
+#define RBUFSIZ (1 << 16)
+#define HC_INI_CAP 256		/* have to be power of 2 */
+
+/* a list `rnext' is in */
+typedef struct {
+	size_t at;		/* of the opening parenthesis */
+	size_t dot;		/* of the dot, from LIST_DOT on, then of the
+			 * list too many in LIST_OVER */
+	enum {
+		LIST_EMPTY,
+		LIST_ITEMS,
+		LIST_DOT,	/* wants the item after the dot */
+		LIST_TAIL,	/* has it, wants the closing parenthesis */
+		LIST_OVER,	/* got a list instead, read through like reades */
+	} state;
+} Open;
+
 struct Reader {
-	FILE *input;
+	const char *buf;	/* buf[0] is the byte at offset `base' */
+	size_t base;
+	size_t len;		/* bytes in the window */
+	size_t cap;		/* 0 if the input is mmaped */
+	size_t tok;		/* window has to keep input from here on */
+	int fd;
+	int eof;
+	int flags;
 	const char *fname;
 	size_t cursor;
 	ReadErr err;
+	struct {		/* R_HASHCONS, of the form being read */
+		Cell **tab;	/* open addressing, linear probing */
+		size_t cap;
+		size_t len;
+		Vec(Cell *) items;	/* of the lists not read to the end */
+		Vec(Range) locs;	/* of every atom and list so far */
+	} hc;
+	struct {		/* `rnext' */
+		Arena *arena;	/* the atom of the last event */
+		Vec(Open) open;
+	} ev;
 };
 
+#define RPTR(reader, at) ((reader)->buf + ((at) - (reader)->base))
+#define REND(reader)     ((reader)->buf + (reader)->len)
+
 const char *
 readerr(Reader *reader)
 {
@@ -78,16 +128,30 @@ readerrat(Reader *reader)
 Reader *
 ropen(const char *fname)
 {
+	struct stat st;
 	Reader *reader = calloc(1, sizeof(Reader));
 	if (!fname) {
-		reader->input = stdin;
+		reader->fd = STDIN_FILENO;
 		fname = "<stdin>";
 	}
-	else if (!(reader->input = fopen(fname, "r"))) {
+	else if ((reader->fd = open(fname, O_RDONLY)) < 0) {
 		perror("ropen:");
+		free(reader);
 		return nil;
 	}
 	reader->fname = fname;
+	if (!fstat(reader->fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map = mmap(nil, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			reader->buf = map;
+			reader->len = st.st_size;
+			reader->eof = 1;
+			return reader;
+		}
+	}
+	reader->cap = RBUFSIZ;
+	reader->buf = malloc(reader->cap);
 	return reader;
 }
 
@@ -100,90 +164,309 @@ readeof(Reader *reader)
 void
 rclose(Reader *reader)
 {
-	fclose(reader->input);
+	if (reader->cap) free((char *)reader->buf);
+	else munmap((char *)reader->buf, reader->len);
+	if (reader->hc.tab) {
+		free(reader->hc.tab);
+		vec_free(reader->hc.items);
+		vec_free(reader->hc.locs);
+	}
+	if (reader->ev.arena) {
+		deinit(reader->ev.arena);
+		vec_free(reader->ev.open);
+	}
+	if (reader->fd != STDIN_FILENO) close(reader->fd);
 	free(reader);
 }
 
-static int
-istermsexp(char chr)
+/* read more input into the window, dropping what's before `tok' */
+static size_t
+rfill(Reader *reader)
+{
+	ssize_t n;
+	char *buf = (char *)reader->buf;
+	if (reader->eof) return 0;
+	if (reader->tok > reader->base) {
+		size_t drop = reader->tok - reader->base;
+		memmove(buf, buf + drop, reader->len - drop);
+		reader->len -= drop;
+		reader->base = reader->tok;
+	}
+	if (reader->cap - reader->len < RBUFSIZ / 2) {
+		reader->cap <<= 1;
+		reader->buf = buf = realloc(buf, reader->cap);
+	}
+	while ((n = read(reader->fd, buf + reader->len, reader->cap - reader->len)) < 0
+	       && errno == EINTR);
+	if (n <= 0) {
+		reader->eof = 1;
+		return 0;
+	}
+	reader->len += n;
+	return n;
+}
+
+void
+rflags(Reader *reader, int flags)
+{
+	reader->flags = flags;
+	if (flags & R_HASHCONS && !reader->hc.tab) {
+		reader->hc.cap = HC_INI_CAP;
+		reader->hc.tab = calloc(reader->hc.cap, sizeof(Cell *));
+		vec_ini(reader->hc.items);
+		vec_ini(reader->hc.locs);
+	}
+	if (!(flags & R_SLICE) || !reader->cap) return;
+	reader->tok = reader->base; /* slices need the whole input to stay put */
+	while (rfill(reader));
+}
+
+/* move the cursor to where `scan' stops, refilling the window on the way */
+static void
+rscan(Reader *reader, Scan scan)
 {
-	return (strchr(")(`'.#", chr) || isspace(chr) || chr == EOF);
+	const char *p;
+	do {
+		p = scan(RPTR(reader, reader->cursor), REND(reader));
+		reader->cursor = reader->base + (p - reader->buf);
+	} while (p == REND(reader) && rfill(reader));
 }
 
 static int
 rgetc(Reader *reader)
 {
-	char ch = fgetc(reader->input);
-	if (ch != EOF) reader->cursor++;
-	return ch;
+	if (reader->cursor == reader->base + reader->len && !rfill(reader))
+		return EOF;
+	return (uchar)*RPTR(reader, reader->cursor++);
 }
 
 static void
-rungetc(Reader *reader, char chr)
+rungetc(Reader *reader, int chr)
 {
-	reader->cursor--; ungetc(chr, reader->input);
+	if (chr != EOF) reader->cursor--;
 }
 
+/* scan the string body up to and including the closing quote,
+ * returns the lenght consumed, `terminated' is set if quote was found
+ * and `escaped' if the body has any escapes */
 static size_t
-readstr(Reader *reader, Vec(char) str)
+readstr(Reader *reader, int *terminated, int *escaped)
 {
-	char chr;
-	int esc = 0;
+	int chr;
 	size_t pos = reader->cursor;
-	while ((chr = rgetc(reader)) != EOF) {
-		if (esc) {
-			esc = 0;
-			switch (chr) {
-			case '\\': vec_push(str, chr); continue;
-			case '"': vec_push(str, chr);  continue;
-			case 'n': vec_push(str, '\n'); continue;
-			case 't': vec_push(str, '\t'); continue;
-			}
-		} else if (chr == '"') break;
-		if ((esc = (chr == '\\'))) continue;
-		vec_push(str, chr);
+	*escaped = 0;
+	for (;;) {
+		rscan(reader, scanstr);
+		if ((chr = rgetc(reader)) != '\\') break;
+		*escaped = 1;
+		if (rgetc(reader) == EOF) break;
 	}
-	vec_push(str, '\0');
+	*terminated = chr == '"';
 	return reader->cursor - pos;
 }
 
+static char *
+copystr(Arena *arena, const char *src, size_t len)
+{
+	char *str = anew(arena, len + 1, "string");
+	memcpy(str, src, len);
+	str[len] = '\0';
+	return str;
+}
+
+/* copy the string body of lenght `len' at `src' resolving escapes,
+ * the lenght of the result is stored in `res' */
+static char *
+unescape(Arena *arena, const char *src, size_t len, uint32_t *res)
+{
+	char *str = anew(arena, len + 1, "string");
+	char *dst = str;
+	const char *end = src + len;
+	while (src < end) {
+		if (*src != '\\' || src + 1 == end) {
+			*dst++ = *src++;
+			continue;
+		}
+		switch (*++src) {
+		case 'n': *dst++ = '\n'; break;
+		case 't': *dst++ = '\t'; break;
+		default:  *dst++ = *src; break;
+		}
+		src++;
+	}
+	*dst = '\0';
+	*res = dst - str;
+	return str;
+}
+
+/* strtol(3) for base 10 without the need for NUL terminator */
+static int
+readint(const char *sym, size_t len, int *val)
+{
+	const char *end = sym + len;
+	int neg = 0;
+	long num = 0;
+	if (sym < end && (*sym == '-' || *sym == '+')) neg = *sym++ == '-';
+	if (sym == end) return 0;
+	for (; sym < end; sym++) {
+		if (!isdigit((uchar)*sym)) return 0;
+		int d = *sym - '0';
+		if (num > (LONG_MAX - d) / 10) num = LONG_MAX;	/* clamp */
+		else num = num * 10 + d;
+	}
+	*val = neg ? -num : num;
+	return 1;
+}
+
 static size_t
-readsym(Reader *reader, Vec(char) str)
+readsym(Reader *reader)
 {
-	char chr;
 	size_t pos = reader->cursor;
-	while (!istermsexp(chr = rgetc(reader))) {
-		vec_push(str, chr);
-	}
-	rungetc(reader, chr);
-	vec_push(str, '\0');
+	rscan(reader, scansym);
 	return reader->cursor - pos;
 }
 
-static char
+static int
 skipspace(Reader *reader)
 {
-	char chr;
-	while (isspace(chr = rgetc(reader)) && chr != EOF);
-	return chr;
+	reader->tok = reader->cursor;
+	rscan(reader, scanspace);
+	reader->tok = reader->cursor;
+	return rgetc(reader);
 }
 
-static char
+static int
 skipcom(Reader *reader)
 {
-	char chr;
+	int chr;
 	chr = skipspace(reader);
 	if (chr == ';') {
-		while ((chr = rgetc(reader)) != '\n' && chr != EOF);
+		reader->tok = reader->cursor;
+		rscan(reader, scanline);
 		chr = skipspace(reader);
 	}
 	return chr;
 }
 
+/* ;; HASH CONSING ;; */
+/* Cells are looked up after they are made, a cell already there gets
+ * them released. Conses are made once their car and cdr are in the
+ * table, so comparing those is comparing whole subtrees. */
+static uint64_t
+hchash(Cell *cell)
+{
+	Cell *c = CELL(cell);
+	uint64_t key[2] = { CONSP(cell) ? (uint64_t)-1 : c->type, 0 };
+	if (CONSP(cell)) key[1] = (uint64_t)c->car_ << 32 | c->cdr_;
+	else switch (c->type) {
+	case A_STR:   key[1] = hash_keyn(c->string, c->slen); break;
+	case A_SYM:   key[1] = c->sym->hash; break;
+	case A_INT:   key[1] = (uint32_t)c->integer; break;
+	case A_DOUBL: memcpy(&key[1], &c->doubl, sizeof(double)); break;
+	case A_VEC:   assert(0 && "unimplemented"); break;
+	}
+	return hash_keyn((const char *)key, sizeof(key));
+}
+
+static int
+hceq(Cell *a, Cell *b)
+{
+	Cell *x = CELL(a), *y = CELL(b);
+	if (CONSP(a) || CONSP(b))
+		return CONSP(a) && CONSP(b) && x->car_ == y->car_ && x->cdr_ == y->cdr_;
+	if (x->type != y->type) return 0;
+	switch (x->type) {
+	case A_STR:   return x->slen == y->slen && !memcmp(x->string, y->string, x->slen);
+	case A_SYM:   return x->sym == y->sym;
+	case A_INT:   return x->integer == y->integer;
+	case A_DOUBL: return !memcmp(&x->doubl, &y->doubl, sizeof(double));
+	default:      return 0;
+	}
+}
+
+static size_t
+hcfind(Reader *reader, Cell *cell)
+{
+	size_t mask = reader->hc.cap - 1, idx = hchash(cell) & mask;
+	for (Cell *c; (c = reader->hc.tab[idx]); idx = (idx + 1) & mask)
+		if (hceq(c, cell)) break;
+	return idx;
+}
+
+static void
+hcgrow(Reader *reader)
+{
+	Cell **old = reader->hc.tab;
+	size_t oldcap = reader->hc.cap;
+	reader->hc.cap <<= 1;
+	reader->hc.tab = calloc(reader->hc.cap, sizeof(Cell *));
+	for (size_t i = 0; i < oldcap; i++)
+		if (old[i]) reader->hc.tab[hcfind(reader, old[i])] = old[i];
+	free(old);
+}
+
+/* forget the cells of the last form, the arena may not have them now */
+static void
+hcreset(Reader *reader)
+{
+	if (!(reader->flags & R_HASHCONS)) return;
+	if (reader->hc.cap > HC_INI_CAP && reader->hc.len * 8 < reader->hc.cap) {
+		free(reader->hc.tab);	/* don't clear a big table for small forms */
+		reader->hc.cap = HC_INI_CAP;
+		reader->hc.tab = calloc(reader->hc.cap, sizeof(Cell *));
+	} else {
+		memset(reader->hc.tab, 0, reader->hc.cap * sizeof(Cell *));
+	}
+	reader->hc.len = 0;
+	vecptr(reader->hc.items)->len = 0;
+	vecptr(reader->hc.locs)->len = 0;
+}
+
+/* the cell equal to `cell' if there is one, then everything allocated
+ * since `mark' is released, otherwise `cell' */
+static Cell *
+hcintern(Arena *arena, Reader *reader, Cell *cell, Amark mark)
+{
+	size_t idx = hcfind(reader, cell);
+	if (reader->hc.tab[idx]) {
+		ashare(arena, mark);
+		return reader->hc.tab[idx];
+	}
+	reader->hc.tab[idx] = cell;
+	if (++reader->hc.len * 2 > reader->hc.cap) hcgrow(reader);
+	return cell;
+}
+
+/* atom `cell' made since `mark' */
+static Cell *
+hcatom(Arena *arena, Reader *reader, Cell *cell, Amark mark)
+{
+	if (!(reader->flags & R_HASHCONS)) return cell;
+	vec_push(reader->hc.locs, CELL_LOC(cell));
+	return hcintern(arena, reader, cell, mark);
+}
+
+/* the list of the last `n' items with `rest' as its last cdr, built
+ * from its end, its location went to `slot' of `locs' when it began */
+static Cell *
+hclist(Arena *arena, Reader *reader, size_t n, Cell *rest, size_t slot)
+{
+	Range *loc = &reader->hc.locs[slot];
+	loc->len = reader->cursor - loc->at;
+	while (n--) {
+		Amark mark = amark(arena);
+		Cell *cell = cons(arena, vec_pop(reader->hc.items), rest, loc->at);
+		if (!n) CELL_LEN(cell) = loc->len;
+		rest = hcintern(arena, reader, cell, mark);
+	}
+	return rest;
+}
+
 static Cell *			/* todo split string parsing routines */
 nextitem(Arena *arena, Reader *reader)
 {
-	char chr;
+	int chr;
+	Amark mark = amark(arena);
 	chr = skipcom(reader);
 	switch (chr) {
         case '(':  return (Cell *)BRA;
@@ -198,45 +481,44 @@ nextitem(Arena *arena, Reader *reader)
 		reader->err = (ReadErr){EOF_ERR, reader->cursor};
 		return (Cell *)EOF2;
 	case '"': {		/* todo: test string */
-		VEC(char, str);
+		int terminated, escaped;
 		Cell *cell = cellof(arena, A_ATOM, reader->cursor - 1);
 		cell->type = A_STR;
 		cell->string = nil;
-		CELL_LEN(cell) = readstr(reader, str) + 1 /* + " */;
-		if (feof(reader->input)) {
-			vec_free(str);
+		CELL_LEN(cell) = readstr(reader, &terminated, &escaped) + 1 /* + " */;
+		if (!terminated) {
 			reader->err = (ReadErr){EOF_ERR, reader->cursor};
 			return nil;
 		}
-		cell->string = new(arena, strlen(str) + 1);
-		strcpy(cell->string, str);
-		vec_free(str);
-		return cell;
+		const char *str = RPTR(reader, CELL_AT(cell) + 1);
+		cell->slen = CELL_LEN(cell) - 2;
+		if (escaped)
+			cell->string = unescape(arena, str, cell->slen, &cell->slen);
+		else if (reader->flags & R_SLICE)
+			cell->string = str;
+		else
+			cell->string = copystr(arena, str, cell->slen);
+		return hcatom(arena, reader, cell, mark);
  	} default:		/* todo: add double */
 		  rungetc(reader, chr);
-		  VEC(char, sym);
 		  Cell *cell = cellof(arena, A_ATOM, reader->cursor);
-		  CELL_LEN(cell) = readsym(reader, sym);
-		  char *endptr;
+		  CELL_LEN(cell) = readsym(reader);
+		  const char *sym = RPTR(reader, CELL_AT(cell));
 		  /* if looks like number it's number */
-		  cell->integer = strtol(sym, &endptr, 10);
-		  if (*endptr == '\0') {
-			  vec_free(sym);
+		  if (readint(sym, CELL_LEN(cell), &cell->integer)) {
 			  cell->type = A_INT;
-			  return cell;
-
+			  return hcatom(arena, reader, cell, mark);
 		  }
 		  cell->type = A_SYM;
-		  cell->string = new(arena, strlen(sym) + 1);
-		  strcpy(cell->string, sym);
-		  vec_free(sym);
-		  return cell;
+		  cell->sym = intern(sym, CELL_LEN(cell));
+		  return hcatom(arena, reader, cell, mark);
 	}
 }
 
-
+
 /* ;; READ SEXP ;; */
 /* -es stands for (e)S-expression */
+static Cell * readitem(Arena *arena, Reader *reader, Cell *item);
 static Cell * reades_(Arena *arena, Reader *reader);
 
 static void
@@ -263,7 +545,13 @@ readrest(Arena *arena, Reader *reader)
 	Cell *tl = nil;
 	Cell *hd = nil;
 	Cell *errel = nil;
+	Cell *rest;
 	size_t begcur = reader->cursor - 1;
+	size_t n = 0, slot = 0;
+	if (reader->flags & R_HASHCONS) {
+		slot = vec_len(reader->hc.locs);
+		vec_push(reader->hc.locs, ((Range){begcur, 0}));
+	}
 	Cell *item = nextitem(arena, reader);
 	while (item != (Cell *)KET) {
 		switch ((uint64_t)item) {
@@ -278,7 +566,7 @@ readrest(Arena *arena, Reader *reader)
 			}
 			break;
 		case DOT:  /* expected is DOT <sexp> KET, otherwise error */
-			if (!tl) {
+			if (!n) {
 				reader->err = (ReadErr){
 					NOTHING_BEFORE_DOT_ERR,
 					reader->cursor - 1
@@ -286,7 +574,7 @@ readrest(Arena *arena, Reader *reader)
 				return nil;
 			}
 			size_t prevcur = reader->cursor - 1;
-			CDR(tl) = reades_(arena, reader);
+			rest = reades_(arena, reader);
 			if (reader->err.type) {
 				if (reader->err.type == UNMATCHED_KET_ERR) {
 					reader->err = (ReadErr){
@@ -302,33 +590,47 @@ readrest(Arena *arena, Reader *reader)
 			 * consumed by `discardsexp' on synchronization
 			 */
 			prevcur = reader->err.at;
-			if ((errel = reades_(arena, reader)) != nil) {
+			item = nextitem(arena, reader);
+			size_t itemcur = reader->cursor - 1;
+			errel = readitem(arena, reader, item);
+			/* () is nil too, but it's an object all the same */
+			if (errel || (item == (Cell *)BRA && !reader->err.type)) {
 				reader->err = (ReadErr){
 					DOT_MANY_FOLLOW_ERR,
-					CELL_AT(errel),
+					errel ? CELL_AT(errel) : itemcur,
 				};
 				return nil;
 			}
 			if (reader->err.type != UNMATCHED_KET_ERR)
 				return nil; /* propagate further same error */
 			reader->err = (ReadErr){OK, prevcur}; /* proper sexp */
-			if (hd) CELL_LEN(hd) = reader->cursor - begcur;
+			if (reader->flags & R_HASHCONS)
+				return hclist(arena, reader, n, rest, slot);
+			SET_CDR(tl, rest);
+			CELL_LEN(hd) = reader->cursor - begcur;
 			return hd;
 		}
-		Cell *cell = cons(arena, item, nil, begcur);
-		if (!hd) hd = cell;
-		else CDR(tl) = cell;
-		tl = cell;
+		if (reader->flags & R_HASHCONS) {
+			vec_push(reader->hc.items, item);
+		} else {
+			Cell *cell = cons(arena, item, nil, begcur);
+			if (!hd) hd = cell;
+			else SET_CDR(tl, cell);
+			tl = cell;
+		}
+		n++;
 		item = nextitem(arena, reader);
 	}
+	if (reader->flags & R_HASHCONS)
+		return hclist(arena, reader, n, nil, slot);
 	if (hd) CELL_LEN(hd) = reader->cursor - begcur;
 	return hd;
 }
 
+/* the sexp that begins with `item' */
 static Cell *
-reades_(Arena *arena, Reader *reader)
+readitem(Arena *arena, Reader *reader, Cell *item)
 {
-	Cell *item = nextitem(arena, reader);
 	switch ((uint64_t)item) {
 	case EOF2: return nil;
 	case 0:    return nil;
@@ -344,25 +646,166 @@ reades_(Arena *arena, Reader *reader)
 	}
 }
 
+static Cell *
+reades_(Arena *arena, Reader *reader)
+{
+	return readitem(arena, reader, nextitem(arena, reader));
+}
+
+/* the locations R_HASHCONS kept aside, into the arena of `sexp' */
+static void
+readlocs(Reader *reader, Sexp *sexp)
+{
+	sexp->locs = nil;
+	sexp->nlocs = 0;
+	if (!(reader->flags & R_HASHCONS)) return;
+	sexp->nlocs = vec_len(reader->hc.locs);
+	sexp->locs = anew(sexp->arena, sexp->nlocs * sizeof(Range), "locs");
+	memcpy(sexp->locs, reader->hc.locs, sexp->nlocs * sizeof(Range));
+}
+
+/* The span of the last sexp freed, reset, for the next one. A span
+ * costs a few mmaps and fresh pages to fault in, too much for a form. */
+static Arena *spare;
+
 Sexp *
 reades(Reader *reader)
 {
 	Sexp *sexp = malloc(sizeof(Sexp));
-	sexp->arena = aini();	/* imagine trying to clear memory without arena */
+	sexp->arena = spare ? spare : aspan(4096);	/* imagine trying to clear memory without arena */
+	spare = nil;
 	sexp->fname = reader->fname;
 	reader->err = (ReadErr){OK, reader->cursor};
+	hcreset(reader);
 	sexp->cell = reades_(sexp->arena, reader);
+	readlocs(reader, sexp);
+	return sexp;
+}
+
+Sexp *
+readesa(Reader *reader, Arena *arena)
+{
+	Sexp *sexp = anew(arena, sizeof(Sexp), "sexp");
+	sexp->arena = arena;
+	sexp->fname = reader->fname;
+	reader->err = (ReadErr){OK, reader->cursor};
+	hcreset(reader);
+	sexp->cell = reades_(arena, reader);
+	readlocs(reader, sexp);
 	return sexp;
 }
 
 void
 sexpfree(Sexp *sexp)
 {
-	deinit(sexp->arena);	/* I fucking love arena */
+	if (spare) {
+		deinit(sexp->arena);	/* I fucking love arena */
+	} else {
+		areset(sexp->arena);
+		spare = sexp->arena;
+	}
 	free(sexp);
 }
 
 
+/* ;; STREAM ;; */
+/* The checks of `readrest' over a stack of the lists the stream is in,
+ * errors are reported where `reades' would report them. */
+static REventType
+everr(Reader *reader, REvent *ev, int type, size_t at)
+{
+	reader->err = (ReadErr){type, at};
+	return ev->type = EV_ERR;
+}
+
+/* an atom or a list begins at `at' */
+static int
+evitem(Reader *reader, REvent *ev, Cell *item, size_t at)
+{
+	Open *top;
+	if (!vec_len(reader->ev.open)) return 1;
+	top = &vec_end(reader->ev.open);
+	switch (top->state) {
+	case LIST_EMPTY: top->state = LIST_ITEMS; break;
+	case LIST_ITEMS: break;
+	case LIST_DOT:   top->state = LIST_TAIL; break;
+	case LIST_TAIL:
+		if (item == (Cell *)BRA) {	/* the error once it's closed */
+			top->state = LIST_OVER;
+			top->dot = at;
+			break;
+		}
+		everr(reader, ev, DOT_MANY_FOLLOW_ERR, at);
+		return 0;
+	case LIST_OVER: break;	/* the list inside is the top one */
+	}
+	return 1;
+}
+
+REventType
+rnext(Reader *reader, REvent *ev)
+{
+	int flags = reader->flags;
+	Open *top;
+	Cell *item;
+	size_t at;
+	if (!reader->ev.arena) {
+		reader->ev.arena = aini();
+		vec_ini(reader->ev.open);
+	}
+	if (reader->err.type)	/* the stream ended */
+		return ev->type = readeof(reader) ? EV_END : EV_ERR;
+	areset(reader->ev.arena);
+	reader->flags &= ~R_HASHCONS;	/* the atoms don't outlive the event */
+	item = nextitem(reader->ev.arena, reader);
+	reader->flags = flags;
+	top = vec_len(reader->ev.open) ? &vec_end(reader->ev.open) : nil;
+	at = reader->tok;	/* where the token began */
+	ev->loc = (Range){at, reader->cursor - at};
+	switch ((uint64_t)item) {
+	case EOF2:
+	case 0:			/* or a string without its closing quote */
+		/* `reades' leaves the end of a file after a dot expected */
+		if (top && top->state != LIST_DOT && top->state != LIST_TAIL)
+			reader->err.type = EOFU_ERR;
+		return ev->type = top || !item ? EV_ERR : EV_END;
+	case BRA:
+		if (!evitem(reader, ev, item, at)) return EV_ERR;
+		vec_push(reader->ev.open, ((Open){at, 0, LIST_EMPTY}));
+		return ev->type = EV_OPEN;
+	case KET:
+		if (!top) return everr(reader, ev, UNMATCHED_KET_ERR, at);
+		if (top->state == LIST_DOT)
+			return everr(reader, ev, NOTHING_AFTER_DOT_ERR, top->dot);
+		ev->loc = (Range){top->at, reader->cursor - top->at};
+		vecptr(reader->ev.open)->len--;
+		top = vec_len(reader->ev.open) ? &vec_end(reader->ev.open) : nil;
+		if (top && top->state == LIST_OVER)
+			return everr(reader, ev, DOT_MANY_FOLLOW_ERR, top->dot);
+		return ev->type = EV_CLOSE;
+	case DOT:
+		if (!top || top->state == LIST_DOT || top->state == LIST_TAIL)
+			return everr(reader, ev, DOT_CONTEXT_ERR, at);
+		if (top->state == LIST_EMPTY)
+			return everr(reader, ev, NOTHING_BEFORE_DOT_ERR, at);
+		top->state = LIST_DOT;
+		top->dot = at;
+		return ev->type = EV_DOT;
+	case SKET:
+		return everr(reader, ev, UNMATCHED_SKET_ERR, at);
+	case SBRA: case QUOTE: case BSTICK: case HASH:
+		return everr(reader, ev, TOKEN_ERR, at);
+	default:
+		if (!evitem(reader, ev, item, at)) return EV_ERR;
+		ev->atom = item->type;
+		ev->text = RPTR(reader, at);
+		ev->len = ev->loc.len;
+		ev->cell = item;
+		return ev->type = EV_ATOM;
+	}
+}
+
+
 /* ;; PRINTER ;; */
 static void
 printes_(Cell *cell) {
@@ -387,8 +830,8 @@ printes_(Cell *cell) {
 	}
 	if (ATOMP(cell)) {
 		switch (cell->type) {
-		case A_STR: printf("\"%s\"", cell->string); break;
-		case A_SYM: printf("%s", cell->string);     break;
+		case A_STR: printf("\"%.*s\"", (int)cell->slen, cell->string); break;
+		case A_SYM: printf("%s", cell->sym->name);     break;
 		case A_INT: printf("%d", cell->integer);    break;
 		case A_DOUBL: printf("%f", cell->doubl);    break;
 		case A_VEC: assert(0 && "unimplemented");   break;
@@ -4,12 +4,56 @@
 
 #define PRINTES_LOCATION 1
 
+enum {
+	R_SLICE = 1 << 0,	/* strings point into the input, see `rflags' */
+	R_HASHCONS = 1 << 1,	/* equal subtrees are one, see `rflags' */
+};
+
 typedef struct Reader Reader;
 const char *readerr(Reader *reader);
 size_t readerrat(Reader *reader);
 int readeof(Reader *reader);
 Reader *ropen(const char *input);
+/* Symbols are always interned (see sym.h). With R_SLICE strings without
+ * escapes are not copied but point into the input, which is then read
+ * whole if it isn't mmaped.
+ * Their `string' is not NUL terminated (use `slen') and lives only
+ * as long as the reader does.
+ * With R_HASHCONS equal atoms and conses of a form are the same cell,
+ * so equal subtrees are equal pointers. The cells must not be changed
+ * then, and the location of a shared one is where it was first read.
+ * The location of every atom and list is in the Sexp's `locs' instead,
+ * in the order they start in the input. */
+void rflags(Reader *reader, int flags);
 void rclose(Reader *reader);
 Sexp *reades(Reader *reader);
+/* read into `arena' owned by caller, made by `aspan', don't `sexpfree' the result */
+Sexp *readesa(Reader *reader, Arena *arena);
 void sexpfree(Sexp *sexp);
 void printes(Sexp *sexp);
+
+/* `rnext' reads the input an event at a time instead of a form at a
+ * time, in memory bounded by the nesting depth and the longest atom
+ * (symbols are still interned). An event is only valid until the next
+ * call. The stream ends with EV_END at the end of input, or with EV_ERR
+ * which `readerr' and `readerrat' explain as they do for `reades'.
+ * R_HASHCONS doesn't apply to it. */
+typedef enum {
+	EV_OPEN,
+	EV_CLOSE,
+	EV_ATOM,
+	EV_DOT,
+	EV_END,
+	EV_ERR,
+} REventType;
+
+typedef struct {
+	REventType type;
+	Range loc;		/* for EV_CLOSE that of the whole list */
+	AtomVar atom;		/* EV_ATOM only from here on */
+	const char *text;	/* the atom as written, not NUL terminated */
+	size_t len;
+	Cell *cell;		/* the atom as `reades' would read it */
+} REvent;
+
+REventType rnext(Reader *reader, REvent *ev);
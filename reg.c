@@ -0,0 +1,180 @@
+#include "aux.h"
+#include "sym.h"
+#include "types/value.h"
+#include "types/arena.h"
+#include "types/sexp.h"
+#include "types/vec.h"
+#include "types/ht.h"
+#include "compi.h"
+#include "reg.h"
+
+/* The translation runs the stack code symbolically, the simulated stack
+ * holds the register each pushed value lives in. A LOAD_LEX pushes the
+ * binding's own register, so locals are never copied just to be read. */
+typedef struct {
+	RChunk *rc;
+	uint8_t stack[REG_MAX];
+	size_t sp;
+	ptrdiff_t lastdst;	/* offset of the d operand written last, or -1 */
+} RComp;
+
+static void
+remit(RComp *rc, size_t from, int n, uint8_t op, uint8_t x, uint8_t y, uint8_t z)
+{
+	uint8_t ops[] = { op, x, y, z };
+	vec_push(rc->rc->from, from);
+	for (int i = 0; i < n; i++) vec_push(rc->rc->code, ops[i]);
+	rc->lastdst = -1;
+}
+
+/* op, one register, then the constant index `k' as LEB128 like in the
+ * stack code */
+static void
+remitk(RComp *rc, size_t from, uint8_t op, uint8_t x, size_t k)
+{
+	remit(rc, from, 2, op, x, 0, 0);
+	for (; k >= 0x80; k >>= 7)
+		vec_push(rc->rc->code, (k & 0x7f) | 0x80);
+	vec_push(rc->rc->code, k);
+}
+
+static size_t
+arg(Chunk *chunk, size_t *ip)
+{
+	size_t len, arg = uleb(chunk->code + *ip, &len);
+	*ip += len;
+	return arg;
+}
+
+/* register for a new value at the top of the simulated stack */
+static int
+rtemp(RComp *rc, uint8_t *reg)
+{
+	size_t r = rc->rc->chunk->nlocals + rc->sp;
+	if (r >= REG_MAX) return 0;
+	if (r + 1 > rc->rc->nregs) rc->rc->nregs = r + 1;
+	*reg = r;
+	return 1;
+}
+
+/* pop the top of the simulated stack into lexical `slot' */
+static int
+rbind(RComp *rc, size_t at, size_t slot)
+{
+	RChunk *r = rc->rc;
+	uint8_t a, d;
+	if (slot >= r->chunk->nlocals || rc->sp < 1) return 0;
+	a = rc->stack[--rc->sp];
+	/* values still on the stack that were read from the slot keep the
+	 * old value */
+	for (size_t i = 0; i < rc->sp; i++) {
+		if (rc->stack[i] != slot) continue;
+		size_t save = rc->sp;
+		rc->sp = i;
+		if (!rtemp(rc, &d)) return 0;
+		rc->sp = save;
+		remit(rc, at, 3, R_MOV, d, slot, 0);
+		rc->stack[i] = d;
+	}
+	if (a == slot) return 1;
+	if (rc->lastdst >= 0 && r->code[rc->lastdst] == a) {
+		r->code[rc->lastdst] = slot;	/* compute straight into it */
+		rc->lastdst = -1;
+		return 1;
+	}
+	remit(rc, at, 3, R_MOV, slot, a, 0);
+	return 1;
+}
+
+RChunk *
+regcompile(Chunk *chunk)
+{
+	RComp rc = { .lastdst = -1 };
+	RChunk *r = malloc(sizeof(RChunk));
+	r->chunk = chunk;
+	r->nregs = chunk->nlocals;
+	vec_ini(r->code);
+	vec_ini(r->from);
+	rc.rc = r;
+	if (chunk->nlocals > REG_MAX) goto FAIL;
+	uint8_t parts[SUPER_MAX];
+	int nparts = 0, part = 0;
+	size_t at = 0;
+	/* a superinstruction is translated part by part */
+	for (size_t ip = 0; ip < vec_len(chunk->code) || part < nparts;) {
+		uint8_t op, a, b, d;
+		if (part == nparts) {
+			at = ip;
+			nparts = superparts(chunk->code[ip++], parts);
+			part = 0;
+		}
+		switch (op = parts[part++]) {
+		case OP_CONS:
+		case OP_LOAD_DYN: {
+			size_t start = vec_len(r->code);
+			if (!rtemp(&rc, &d)) goto FAIL;
+			remitk(&rc, at, op == OP_CONS ? R_CONS : R_LOAD_DYN, d, arg(chunk, &ip));
+			rc.stack[rc.sp++] = d;
+			rc.lastdst = start + 1;
+			break;
+		}
+		case OP_BIND_DYN:
+			if (rc.sp < 1) goto FAIL;
+			remitk(&rc, at, R_BIND_DYN, rc.stack[--rc.sp], arg(chunk, &ip));
+			break;
+		case OP_LOAD_LEX: {
+			size_t slot = arg(chunk, &ip);
+			if (slot >= chunk->nlocals || rc.sp == REG_MAX) goto FAIL;
+			rc.stack[rc.sp++] = slot;
+			rc.lastdst = -1;
+			break;
+		}
+		case OP_BIND_LEX:
+			if (!rbind(&rc, at, arg(chunk, &ip))) goto FAIL;
+			break;
+		case OP_TEE_LEX: {
+			size_t slot = arg(chunk, &ip);
+			if (!rbind(&rc, at, slot)) goto FAIL;
+			rc.stack[rc.sp++] = slot;
+			rc.lastdst = -1;
+			break;
+		}
+		case OP_NEG:
+			if (rc.sp < 1) goto FAIL;
+			a = rc.stack[--rc.sp];
+			if (!rtemp(&rc, &d)) goto FAIL;
+			remit(&rc, at, 3, R_NEG, d, a, 0);
+			rc.stack[rc.sp++] = d;
+			rc.lastdst = vec_len(r->code) - 2;
+			break;
+		case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+			if (rc.sp < 2) goto FAIL;
+			b = rc.stack[--rc.sp];
+			a = rc.stack[--rc.sp];
+			if (!rtemp(&rc, &d)) goto FAIL;
+			remit(&rc, at, 4, R_ADD + (op - OP_ADD), d, a, b);
+			rc.stack[rc.sp++] = d;
+			rc.lastdst = vec_len(r->code) - 3;
+			break;
+		case OP_RET:
+			if (rc.sp < 1) goto FAIL;
+			remit(&rc, at, 2, R_RET, rc.stack[--rc.sp], 0, 0);
+			break;
+		default:
+			goto FAIL;
+		}
+	}
+	return r;
+FAIL:
+	rchunkfree(r);
+	return nil;
+}
+
+void
+rchunkfree(RChunk *rchunk)
+{
+	if (!rchunk) return;
+	vec_free(rchunk->code);
+	vec_free(rchunk->from);
+	free(rchunk);
+}
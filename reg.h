@@ -0,0 +1,44 @@
+/* register bytecode, translated from the stack bytecode of a Chunk */
+/*
+#include "types/vec.h"
+#include "compi.h"
+*/
+
+/* Registers are frame slots. The first `chunk->nlocals' hold the
+ * lexical bindings (the Env.lexbind slots), the stack temporaries of
+ * the stack code get the ones after them. d is the destination
+ * register, a and b source registers, one byte each. k is a conspool
+ * index, LEB128 like the stack code operands (see uleb in compi.h),
+ * and always comes last. The enum and the decomp printer are generated
+ * from ROPS, each op with its operands in order. */
+#define ROPS(X)				\
+	X(RET, "a")			\
+	X(MOV, "da")			\
+	X(CONS, "dk")			\
+	X(BIND_DYN, "ak")		\
+	X(LOAD_DYN, "dk")		\
+	X(NEG, "da")			\
+	X(ADD, "dab")			\
+	X(SUB, "dab")			\
+	X(MUL, "dab")			\
+	X(DIV, "dab")
+
+typedef enum {
+#define X(name, args) R_##name,
+	ROPS(X)
+#undef X
+	R_COUNT,
+} ROpCode;
+
+#define REG_MAX 256
+
+typedef struct {
+	Chunk *chunk;		/* constants and source map, not owned */
+	Vec(uint8_t) code;
+	Vec(uint32_t) from;	/* stack code offset of each instruction */
+	size_t nregs;
+} RChunk;
+
+/* nil if `chunk' uses something the register VM can't do */
+RChunk *regcompile(Chunk *chunk);
+void rchunkfree(RChunk *rchunk);
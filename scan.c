@@ -0,0 +1,206 @@
+/*;; Token Scanning 16 or 32 Bytes at a Time ;;*/
+#include "aux.h"
+#include "scan.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+enum {
+	C_SPACE = 1 << 0,
+	C_TERM  = 1 << 1,	/* ends a symbol */
+	C_LINE  = 1 << 2,
+	C_STR   = 1 << 3,	/* ends a run of plain string bytes */
+};
+
+static uchar class[256] = {
+	['\t'] = C_SPACE | C_TERM,
+	['\n'] = C_SPACE | C_TERM | C_LINE,
+	['\v'] = C_SPACE | C_TERM,
+	['\f'] = C_SPACE | C_TERM,
+	['\r'] = C_SPACE | C_TERM,
+	[' ']  = C_SPACE | C_TERM,
+	['(']  = C_TERM,
+	[')']  = C_TERM,
+	['`']  = C_TERM,
+	['\''] = C_TERM,
+	['.']  = C_TERM,
+	['#']  = C_TERM,
+	['"']  = C_STR,
+	['\\'] = C_STR,
+};
+
+#define SCALAR(name, stop)						\
+static const char *							\
+name##_scalar(const char *p, const char *end)				\
+{									\
+	while (p < end && !(stop)) p++;					\
+	return p;							\
+}
+
+SCALAR(space, !(class[(uchar)*p] & C_SPACE))
+SCALAR(sym,   class[(uchar)*p] & C_TERM)
+SCALAR(line,  class[(uchar)*p] & C_LINE)
+SCALAR(str,   class[(uchar)*p] & C_STR)
+
+#ifdef SCAN_X86
+/* each classifier sets the bytes of `v' the scanner stops at to 0xff */
+#define SSE_EQ(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define AVX_EQ(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+
+static inline __m128i
+sse_space(__m128i v)	/* ' ' or '\t'..'\r' */
+{
+	__m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	ctl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8('\r' - '\t')), ctl);
+	return _mm_or_si128(ctl, SSE_EQ(v, ' '));
+}
+
+static inline __m128i
+sse_nonspace(__m128i v)
+{
+	return _mm_xor_si128(sse_space(v), _mm_set1_epi8(-1));
+}
+
+static inline __m128i
+sse_term(__m128i v)
+{
+	__m128i m = sse_space(v);
+	m = _mm_or_si128(m, _mm_or_si128(SSE_EQ(v, '('), SSE_EQ(v, ')')));
+	m = _mm_or_si128(m, _mm_or_si128(SSE_EQ(v, '`'), SSE_EQ(v, '\'')));
+	return _mm_or_si128(m, _mm_or_si128(SSE_EQ(v, '.'), SSE_EQ(v, '#')));
+}
+
+static inline __m128i sse_line(__m128i v) { return SSE_EQ(v, '\n'); }
+
+static inline __m128i
+sse_str(__m128i v)
+{
+	return _mm_or_si128(SSE_EQ(v, '"'), SSE_EQ(v, '\\'));
+}
+
+#define SSE2(name, classify, scalar)					\
+static const char *							\
+name##_sse2(const char *p, const char *end)				\
+{									\
+	for (; end - p >= 16; p += 16) {				\
+		__m128i v = _mm_loadu_si128((const __m128i *)p);	\
+		int mask = _mm_movemask_epi8(classify(v));		\
+		if (mask) return p + __builtin_ctz(mask);		\
+	}								\
+	return scalar(p, end);						\
+}
+
+SSE2(space, sse_nonspace, space_scalar)
+SSE2(sym,   sse_term,     sym_scalar)
+SSE2(line,  sse_line,     line_scalar)
+SSE2(str,   sse_str,      str_scalar)
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static inline AVX2_TARGET __m256i
+avx_space(__m256i v)
+{
+	__m256i ctl = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+	ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, _mm256_set1_epi8('\r' - '\t')), ctl);
+	return _mm256_or_si256(ctl, AVX_EQ(v, ' '));
+}
+
+static inline AVX2_TARGET __m256i
+avx_nonspace(__m256i v)
+{
+	return _mm256_xor_si256(avx_space(v), _mm256_set1_epi8(-1));
+}
+
+static inline AVX2_TARGET __m256i
+avx_term(__m256i v)
+{
+	__m256i m = avx_space(v);
+	m = _mm256_or_si256(m, _mm256_or_si256(AVX_EQ(v, '('), AVX_EQ(v, ')')));
+	m = _mm256_or_si256(m, _mm256_or_si256(AVX_EQ(v, '`'), AVX_EQ(v, '\'')));
+	return _mm256_or_si256(m, _mm256_or_si256(AVX_EQ(v, '.'), AVX_EQ(v, '#')));
+}
+
+static inline AVX2_TARGET __m256i avx_line(__m256i v) { return AVX_EQ(v, '\n'); }
+
+static inline AVX2_TARGET __m256i
+avx_str(__m256i v)
+{
+	return _mm256_or_si256(AVX_EQ(v, '"'), AVX_EQ(v, '\\'));
+}
+
+#define AVX2(name, classify, sse2)					\
+static AVX2_TARGET const char *						\
+name##_avx2(const char *p, const char *end)				\
+{									\
+	for (; end - p >= 32; p += 32) {				\
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);	\
+		uint mask = _mm256_movemask_epi8(classify(v));		\
+		if (mask) return p + __builtin_ctz(mask);		\
+	}								\
+	return sse2(p, end);						\
+}
+
+AVX2(space, avx_nonspace, space_sse2)
+AVX2(sym,   avx_term,     sym_sse2)
+AVX2(line,  avx_line,     line_sse2)
+AVX2(str,   avx_str,      str_sse2)
+#endif
+
+/* until `scaninit' is called the scanners resolve themselves on first use */
+#define RESOLVE(name)							\
+static const char *							\
+name##_resolve(const char *p, const char *end)				\
+{									\
+	scaninit(SCAN_BEST);						\
+	return scan##name(p, end);					\
+}
+
+RESOLVE(space)
+RESOLVE(sym)
+RESOLVE(line)
+RESOLVE(str)
+
+Scan scanspace = space_resolve;
+Scan scansym   = sym_resolve;
+Scan scanline  = line_resolve;
+Scan scanstr   = str_resolve;
+
+/* pick the scanners, SCAN_BEST is the widest the cpu supports */
+ScanLevel
+scaninit(ScanLevel level)
+{
+#ifdef SCAN_X86
+	if (level == SCAN_BEST || level > SCAN_AVX2)
+		level = __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+	if (level == SCAN_AVX2 && !__builtin_cpu_supports("avx2"))
+		level = SCAN_SSE2;
+#else
+	level = SCAN_SCALAR;
+#endif
+	switch (level) {
+#ifdef SCAN_X86
+	case SCAN_AVX2:
+		scanspace = space_avx2;
+		scansym   = sym_avx2;
+		scanline  = line_avx2;
+		scanstr   = str_avx2;
+		break;
+	case SCAN_SSE2:
+		scanspace = space_sse2;
+		scansym   = sym_sse2;
+		scanline  = line_sse2;
+		scanstr   = str_sse2;
+		break;
+#endif
+	default:
+		level     = SCAN_SCALAR;
+		scanspace = space_scalar;
+		scansym   = sym_scalar;
+		scanline  = line_scalar;
+		scanstr   = str_scalar;
+		break;
+	}
+	return level;
+}
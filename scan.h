@@ -0,0 +1,17 @@
+/* vectorized byte class scanners for the reader */
+/* scanners return the first byte in [p, end) they stop at */
+typedef const char *(*Scan)(const char *p, const char *end);
+
+typedef enum {
+	SCAN_BEST = -1,
+	SCAN_SCALAR,
+	SCAN_SSE2,
+	SCAN_AVX2,
+} ScanLevel;
+
+extern Scan scanspace;	/* stops at non whitespace */
+extern Scan scansym;	/* stops at whitespace or any of )(`'.# */
+extern Scan scanline;	/* stops at newline */
+extern Scan scanstr;	/* stops at " or \ */
+
+ScanLevel scaninit(ScanLevel level);
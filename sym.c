@@ -0,0 +1,75 @@
+/*;; Symbol Interning ;;*/
+#include "aux.h"
+#include "types/arena.h"
+#include "types/ht.h"
+#include "sym.h"
+
+#define SYM_INI_CAP 256		/* have to be power of 2 */
+
+static struct {
+	Arena *arena;		/* symbols live here */
+	Symbol **tab;		/* open addressing, linear probing */
+	size_t cap;
+	size_t len;
+} symtab;
+
+static size_t
+symfind(uint64_t hash, const char *name, size_t len)
+{
+	size_t idx = hash & (symtab.cap - 1);
+	for (Symbol *sym; (sym = symtab.tab[idx]); idx = (idx + 1) & (symtab.cap - 1)) {
+		if (sym->hash == hash && sym->len == len && !memcmp(sym->name, name, len))
+			break;
+	}
+	return idx;
+}
+
+static void
+symgrow(void)
+{
+	Symbol **old = symtab.tab;
+	size_t oldcap = symtab.cap;
+	symtab.cap = oldcap ? oldcap << 1 : SYM_INI_CAP;
+	symtab.tab = calloc(symtab.cap, sizeof(Symbol *));
+	for (size_t i = 0; i < oldcap; i++) {
+		if (!old[i]) continue;
+		size_t idx = old[i]->hash & (symtab.cap - 1);
+		while (symtab.tab[idx]) idx = (idx + 1) & (symtab.cap - 1);
+		symtab.tab[idx] = old[i];
+	}
+	free(old);
+}
+
+Symbol *
+intern(const char *name, size_t len)
+{
+	uint64_t hash = hash_keyn(name, len);
+	if (!symtab.tab) {
+		symtab.arena = aini();
+		symgrow();
+	}
+	size_t idx = symfind(hash, name, len);
+	if (symtab.tab[idx]) return symtab.tab[idx];
+
+	Symbol *sym = anew(symtab.arena, sizeof(Symbol) + len + 1, "symbol");
+	sym->hash = hash;
+	sym->id = symtab.len++;
+	sym->len = len;
+	memcpy(sym->name, name, len);
+	sym->name[len] = '\0';
+	symtab.tab[idx] = sym;
+	if (symtab.len * 2 > symtab.cap) symgrow();
+	return sym;
+}
+
+Symbol *
+internz(const char *name)
+{
+	return intern(name, strlen(name));
+}
+
+size_t
+symcount(void)
+{
+	return symtab.len;
+}
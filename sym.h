@@ -0,0 +1,18 @@
+/* process-wide symbol table */
+/*
+#include "aux.h"
+*/
+
+/* Symbols are interned once and never freed, two symbols with the same
+ * name are the same pointer. `hash' is the FNV-1a hash of the name as
+ * `hash_key' in types/ht.h computes it. */
+typedef struct Symbol {
+	uint64_t hash;
+	size_t id;		/* stable index, in order of interning */
+	uint32_t len;
+	char name[];		/* NUL terminated */
+} Symbol;
+
+Symbol *intern(const char *name, size_t len);
+Symbol *internz(const char *name);
+size_t symcount(void);
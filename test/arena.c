@@ -0,0 +1,37 @@
+/* types/arena.h bumps, alignment and mark/release, and the offsets of a
+ * span arena */
+#define AUX_IMPL
+#include "aux.h"
+#include "types/arena.h"
+#include "test/test.h"
+
+static void
+arenacheck(Arena *a)
+{
+	char *first = new(a, 1);
+	Amark mark = amark(a);
+	char *next = new(a, 1);
+	char *p[64];
+	arelease(a, mark);
+	for (size_t i = 0; i < nelem(p); i++) {
+		size_t al = (size_t)1 << randn(7);
+		p[i] = newal(a, 1 + randn(ARENA_MAX_GROW / 16), al);
+		CHECK(((uintptr_t)p[i] & (al - 1)) == 0);
+		memset(p[i], i, 1);
+		if (a->base) CHECK(ABASE(p[i]) == ABASE(first) && (char *)ABASE(first) + AOFF(p[i]) == p[i]);
+	}
+	for (size_t i = 0; i < nelem(p); i++) CHECK(*p[i] == (char)i);
+	arelease(a, mark);
+	CHECK(new(a, 1) == next);
+	areset(a);
+	CHECK(new(a, 1) == first);
+	deinit(a);
+}
+
+int
+main(void)
+{
+	arenacheck(aini());
+	arenacheck(aspan(4096));
+	return DONE("arena");
+}
@@ -0,0 +1,129 @@
+/* the managed heap under allocation churn: a live set of lists, each
+ * step building a new list of pairs and strings, which mostly dies
+ * young, sometimes replaces a live list and sometimes is linked onto
+ * one, both through heapset. Prints the time and the pause histograms of
+ * heapstats, whose ALL line has the max and p99 pause, collecting the
+ * old generation all at once, in slices of at most `us' and with the
+ * marker thread.
+ * usage: test/gcbench [live MB [us]] */
+#define AUX_IMPL
+#define BENCH
+#include "aux.h"
+#include "sym.h"
+#include "types/value.h"
+#include "types/vec.h"
+#include "heap.h"
+#include "test/test.h"
+
+#define LEN 8			/* pairs in a list */
+#define LISTSIZ (LEN * sizeof(Pair) + LEN / 4 * 24)
+#define STEPS 4000000
+
+/* The live lists are the leaves of a tree of pairs, so like in a
+ * program the roots are few and what's live is in the heap. */
+static Value tree, list, car;	/* the roots, `list' and `car' being built */
+static int depth;
+
+static void
+roots(HeapVisit visit)
+{
+	visit(&tree);
+	visit(&list);
+	visit(&car);
+}
+
+/* the field holding leaf `k', and the pair it's in, the pairs missing
+ * on the way are made */
+static Value *
+slot(size_t k, Obj **parent)
+{
+	Value *v;
+again:
+	v = &tree;
+	*parent = nil;
+	for (int d = depth; d-- > 0;) {
+		if (NILP(*v)) {
+			if (NILP(car)) {	/* it may move everything */
+				Pair *p = heappair();
+				p->car = p->cdr = NIL;
+				car = TO_OBJ(p);
+				goto again;
+			}
+			if (*parent) heapset(*parent, v, car);
+			else *v = car;
+			car = NIL;
+		}
+		*parent = AS_OBJ(*v);
+		v = k >> d & 1 ? &AS_PAIR(*v)->cdr : &AS_PAIR(*v)->car;
+	}
+	return v;
+}
+
+/* `LEN' pairs into `list', every fourth car is a string */
+static void
+build(void)
+{
+	list = NIL;
+	for (int i = 0; i < LEN; i++) {
+		if (i % 4 == 0) {
+			Str *s = heapstr(7);
+			memcpy(s->str, "gcbench", 8);
+			car = TO_OBJ(s);
+		} else {
+			car = TO_INT(i);
+		}
+		Pair *p = heappair();
+		p->car = car;
+		p->cdr = list;
+		list = TO_OBJ(p);
+	}
+	car = NIL;
+}
+
+static void
+run(size_t mb, long us, int thread)
+{
+	Obj *parent;
+	Value *v;
+	size_t nlive;
+	for (depth = 0; (size_t)2 << depth <= mb * (1 << 20) / LISTSIZ; depth++)
+		;
+	nlive = (size_t)1 << depth;
+	tree = list = car = NIL;
+	heapinit(roots, HEAP_YOUNG);
+	heapincremental(us, thread);
+	if (us) printf("gc: %s, %ld us slices\n", thread ? "marker thread" : "incremental", us);
+	else printf("gc: all at once\n");
+	double t = now();
+	for (size_t i = 0; i < nlive; i++) {
+		build();
+		v = slot(i, &parent);
+		heapset(parent, v, list);
+	}
+	printf("gc: %zu MB live in %zu lists %.3f s\n", nlive * LISTSIZ >> 20, nlive, now() - t);
+	t = now();
+	for (size_t i = 0; i < STEPS; i++) {
+		build();
+		v = slot(randn(nlive), &parent);
+		switch (randn(8)) {
+		case 0: heapset(parent, v, list); break;
+		case 1: heapset(AS_OBJ(*v), &AS_PAIR(*v)->cdr, list); break;
+		}
+	}
+	tree = list = NIL;
+	printf("gc: %d lists, %zu MB allocated %.3f s\n", STEPS,
+	       STEPS * LISTSIZ >> 20, now() - t);
+	heapstats(stdout);
+	heapfree();
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t mb = argc > 1 ? strtoul(argv[1], nil, 10) : 1024;
+	long us = argc > 2 ? strtol(argv[2], nil, 10) : HEAP_BUDGET;
+	run(mb, 0, 0);
+	run(mb, us, 0);
+	run(mb, us, 1);
+	return 0;
+}
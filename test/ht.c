@@ -0,0 +1,71 @@
+/* types/ht.h against a plain array of the same keys, through sets,
+ * deletes and growth, copying and borrowing keys, rehashing at once and
+ * incrementally */
+#define AUX_IMPL
+#include "aux.h"
+#include "types/ht.h"
+#include "test/test.h"
+
+#define KEYS 5000
+#define OPS 200000
+
+static char key[KEYS][16];
+static int has[KEYS];
+static int val[KEYS];
+
+static void
+agree(Ht(int) ht, size_t n)
+{
+	size_t len = 0;
+	CHECK(ht_len(ht) == n);
+	for (size_t k = 0; k < KEYS; k++) {
+		size_t idx = ht_find_idx(ht, key[k]);
+		CHECK(ht_idxp(ht, idx) == has[k]);
+		if (has[k]) CHECK(ht[idx] == val[k]);
+		len += has[k];
+	}
+	CHECK(len == n);
+}
+
+/* `keys' live keys at most, few of them churn through tombstones */
+static void
+stress(int borrow, size_t incr, size_t keys)
+{
+	Ht(int) ht;
+	size_t n = 0;
+	ht_ini(ht);
+	if (borrow) ht_borrow(ht);
+	ht_incremental(ht, incr);
+	memset(has, 0, sizeof(has));
+	for (long i = 0; i < OPS; i++) {
+		size_t k = randn(keys);
+		if (randn(3)) {
+			n += !has[k];
+			has[k] = 1;
+			val[k] = rand64();
+			ht_set(ht, key[k], val[k]);
+		} else {
+			int *del = ht_del(ht, key[k]);
+			CHECK(!del == !has[k]);
+			n -= has[k];
+			has[k] = 0;
+		}
+		CHECK(ht_len(ht) == n);
+		if (i % (OPS / 10) == 0) agree(ht, n);
+	}
+	agree(ht, n);
+	ht_free(ht);
+}
+
+int
+main(void)
+{
+	for (size_t k = 0; k < KEYS; k++) snprintf(key[k], sizeof(key[k]), "k%zu", k);
+	size_t incr[] = {0, 1, HT_INCR_STEP};
+	size_t keys[] = {12, 200, KEYS};
+	for (int borrow = 0; borrow < 2; borrow++)
+		for (size_t i = 0; i < nelem(incr); i++)
+			for (size_t j = 0; j < nelem(keys); j++)
+				stress(borrow, incr[i], keys[j]);
+	return DONE("ht");
+}
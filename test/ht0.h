@@ -0,0 +1,130 @@
+/* The table types/ht.h replaced, for test/htbench to compare with. It's
+ * the old header with every name given a 0, nothing else changed. */
+/* single probing resizable hash table / FNV-la hash */
+/* depends:
+#include <stdlib.h>
+*/
+/* NOTE:
+ * This hash map is made for easy handling of primities without storing them in heap.
+ * This is achieved by using macros and = operator inside `ht0_set' which copies
+ * the value directly.
+ *
+ * Althought it's easier to store primities the user has to remember to never
+ * pass the hash table pointer directly because the `ht0_ensure' macro will
+ * override it when resizing the hash map. User has to box the hash table
+ * so the newly assigned address will be not lost.
+ *
+ * If you want to understand this code look first into vec.h which uses the same
+ * idea for storing the buffer for values and metadata.
+ *
+ * To minimalize to number of hash recalculations use the _idx functions with
+ * already generated index from `ht0_find_idx'
+ */
+#define HT0_INI_CAP 16		/* have to be power of 2 */
+#define HT0_MIN_LOAD_FAC 0.65f
+#define HT0_OVERLOAD(ht) ((ht->len / (float)ht->cap) > HT0_MIN_LOAD_FAC)
+
+#define HT0_FNV_OFFSET 14695981039346656037UL
+#define HT0_FNV_PRIME 1099511628211UL
+
+// Return 64-bit FNV-1a hash for key (NUL-terminated). See description:
+// https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
+static inline uint64_t
+ht0_hash_key(const char *key)
+{
+    uint64_t hash = HT0_FNV_OFFSET;
+    for (const char* p = key; *p; p++) {
+        hash ^= (uint64_t)(uchar)(*p);
+        hash *= HT0_FNV_PRIME;
+    }
+    return hash;
+}
+
+typedef struct {
+	size_t cap;
+	size_t len;
+	void (*del)(void *);	/* set this for eventual free */
+	const char **keys;	/* if keys[idx] != nil -> ht[idx] exists */
+} HT0_;
+
+#define Ht0(type) type *
+#define HT0(type, name) type *name = ht0_ini(name)
+
+#define ht0ptr(data) ((HT0_ *)(data)-1)		   /* internals */
+#define ht0data(vec) ((void *)((HT0_ *)(vec)+1))
+
+#define ht0_ini(data) ht0_init(data, HT0_INI_CAP)
+#define ht0_init(data, siz) ht0_init_((void **)&data, sizeof(*data), siz)
+static inline void *		/* function because returns the new vector */
+ht0_init_(void **data, size_t els, size_t cap) /* for assigment operation in VEC */
+{
+	*data = ht0data(malloc(sizeof(HT0_) + cap * els));
+	ht0ptr(*data)->keys = calloc(cap, sizeof(char *));
+	ht0ptr(*data)->cap = cap;
+	ht0ptr(*data)->del = (void*)0;
+	ht0ptr(*data)->len = 0;
+	return *data;
+}
+
+/* gettable (element exists) predicate */
+#define ht0_getp(ht, key) (ht0ptr(ht)->keys[ht0_find_idx(ht, key)] != (void*)0)
+#define ht0_idxp(ht, idx) (ht0ptr(ht)->keys[idx] != (void*)0)
+#define ht0_get(ht, key)  (ht[ht0_find_idx(ht, key)])
+static inline size_t
+ht0_find_idx(void *data, const char *key)
+{
+	uint64_t hash = ht0_hash_key(key);
+	size_t idx = (size_t)(hash & (uint64_t)(ht0ptr(data)->cap - 1)); /* fast modulo */
+	while (ht0ptr(data)->keys[idx]) {
+		if (!strcmp(key, ht0ptr(data)->keys[idx])) return idx;
+		if (++idx >= ht0ptr(data)->cap) idx = 0;
+	}
+	return idx;
+}
+
+#define ht0_del(ht, key)     ht0_del_idx(ht, ht0_find_idx(ht, key))
+#define ht0_del_idx(ht, idx) ht0_del_idx_(ht, sizeof(*ht), idx)
+static inline void *
+ht0_del_idx_(void *data, size_t els, size_t idx)
+{
+	if (!ht0ptr(data)->keys[idx]) return (void*)0;
+	free((char*)ht0ptr(data)->keys[idx]);
+	ht0ptr(data)->keys[idx] = (void*)0; /* unmark key -> delete */
+	void *entry = (uint8_t*)data + els * idx;
+	if (ht0ptr(data)->del) ht0ptr(data)->del(entry);
+	ht0ptr(data)->len--;
+	return entry;
+}
+
+
+#define ht0_ensure(ht) do {						       \
+	if (!HT0_OVERLOAD(ht0ptr(ht))) break;			               \
+	void *nht = ht0_init_((void **)&nht, sizeof(*ht), ht0ptr(ht)->cap << 1); \
+	for (size_t i = 0; i < ht0ptr(ht)->cap; i++) {		               \
+		if (!ht0ptr(ht)->keys[i]) continue;		               \
+		size_t dest = ht0_find_idx(nht, ht0ptr(ht)->keys[i]);            \
+		ht0ptr(nht)->keys[dest] = ht0ptr(ht)->keys[i];		       \
+		memcpy((char*)nht + dest * sizeof(*ht), ht + i, sizeof(*ht));  \
+	}							               \
+	ht0ptr(nht)->len = ht0ptr(ht)->len;				       \
+	free(ht0ptr(ht)->keys);						       \
+	free(ht0ptr(ht));					               \
+	ht = nht;						               \
+} while (0)
+
+
+#define ht0_set(ht, key, val) do {                                              \
+	size_t idx = ht0_find_idx(ht, key);		                       \
+	if (!ht0ptr(ht)->keys[idx]) ht0ptr(ht)->len += 2;			       \
+	ht0_del_idx(ht, idx);						       \
+	ht0ptr(ht)->keys[idx] = strdup(key);				       \
+	ht[idx] = val;					                       \
+	ht0_ensure(ht);							       \
+} while (0)
+
+
+#define ht0_free(ht) do {						       \
+	for (size_t i = 0; i < ht0ptr(ht)->cap; i++) ht0_del_idx(ht, i);         \
+	free(ht0ptr(ht)->keys);						       \
+	free(ht0ptr(ht));						       \
+} while (0)
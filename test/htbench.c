@@ -0,0 +1,78 @@
+/* types/ht.h against the linear probing table it replaced, test/ht0.h,
+ * in ns per operation: inserting n keys, looking up the n present and n
+ * absent ones, a mix of lookups, sets and deletes, then deleting all n.
+ * The old table leaves no tombstones when it deletes, so after the mix
+ * it may miss keys it has, it's timed all the same.
+ * usage: test/htbench [max keys] */
+#define AUX_IMPL
+#define BENCH
+#include "aux.h"
+#include "types/ht.h"
+#include "test/ht0.h"
+#include "test/test.h"
+
+#define KEYLEN 12
+
+static char (*key)[KEYLEN];	/* n present keys, then n absent ones */
+static volatile size_t found;
+
+#define PHASES(P, n, t) do {						\
+	double t0 = now();						\
+	for (size_t i = 0; i < n; i++) P##_set(ht, key[i], (int)i);	\
+	t[0] = now() - t0;						\
+	t0 = now();							\
+	for (size_t i = 0; i < n; i++) found += P##_getp(ht, key[i]);	\
+	t[1] = now() - t0;						\
+	t0 = now();							\
+	for (size_t i = n; i < 2 * n; i++) found += P##_getp(ht, key[i]); \
+	t[2] = now() - t0;						\
+	t0 = now();							\
+	for (size_t i = 0; i < n; i++) {				\
+		size_t k = randn(2 * n);				\
+		switch (randn(4)) {					\
+		case 0: P##_set(ht, key[k], (int)k); break;		\
+		case 1: P##_del(ht, key[k]); break;			\
+		default: found += P##_getp(ht, key[k]);			\
+		}							\
+	}								\
+	t[3] = now() - t0;						\
+	t0 = now();							\
+	for (size_t i = 0; i < 2 * n; i++) P##_del(ht, key[i]);	\
+	t[4] = now() - t0;						\
+} while (0)
+
+static void
+report(const char *name, size_t n, double t[5])
+{
+	printf("ht: %-4s %9zu keys %8.1f insert %8.1f hit %8.1f miss %8.1f mix %8.1f delete ns/op\n",
+	       name, n, t[0] * 1e9 / n, t[1] * 1e9 / n, t[2] * 1e9 / n, t[3] * 1e9 / n,
+	       t[4] * 1e9 / (2 * n));
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t max = argc > 1 ? strtoul(argv[1], nil, 10) : 10000000;
+	double t[5];
+	key = malloc(2 * max * KEYLEN);
+	for (size_t n = 1000; n <= max; n *= 10) {
+		for (size_t i = 0; i < n; i++) snprintf(key[i], KEYLEN, "k%u", (unsigned)i);
+		for (size_t i = 0; i < n; i++) snprintf(key[n + i], KEYLEN, "m%u", (unsigned)i);
+		{
+			Ht(int) ht;
+			ht_ini(ht);
+			PHASES(ht, n, t);
+			ht_free(ht);
+			report("new", n, t);
+		}
+		{
+			Ht0(int) ht;
+			ht0_ini(ht);
+			PHASES(ht0, n, t);
+			ht0_free(ht);
+			report("old", n, t);
+		}
+	}
+	free(key);
+	return 0;
+}
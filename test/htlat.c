@@ -0,0 +1,48 @@
+/* latency of single `ht_set's while a table grows to n keys, rehashing all
+ * at once against `ht_incremental' steps, the tail is where the resizes
+ * are, the median is the common insert.
+ * usage: test/htlat [keys] */
+#define AUX_IMPL
+#define BENCH
+#include "aux.h"
+#include "types/ht.h"
+#include "test/test.h"
+
+#define KEYLEN 12
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n = argc > 1 ? strtoul(argv[1], nil, 10) : 4000000;
+	size_t steps[] = { 0, HT_INCR_STEP, 64 };
+	char (*key)[KEYLEN] = malloc(n * KEYLEN);
+	double *lat = malloc(n * sizeof *lat);
+	for (size_t i = 0; i < n; i++) snprintf(key[i], KEYLEN, "k%u", (unsigned)i);
+	for (size_t s = 0; s < nelem(steps); s++) {
+		Ht(int) ht;
+		ht_ini(ht);
+		ht_incremental(ht, steps[s]);
+		double total = now();
+		for (size_t i = 0; i < n; i++) {
+			double t0 = now();
+			ht_set(ht, key[i], (int)i);
+			lat[i] = now() - t0;
+		}
+		total = now() - total;
+		ht_free(ht);
+		qsort(lat, n, sizeof *lat, cmp);
+		printf("ht: incr %3zu %9zu sets %7.3f s  p50 %8.0f  p99 %8.0f  p999 %8.0f  max %10.0f ns\n",
+		       steps[s], n, total, lat[n / 2] * 1e9, lat[n / 100 * 99] * 1e9,
+		       lat[n / 1000 * 999] * 1e9, lat[n - 1] * 1e9);
+	}
+	free(lat);
+	free(key);
+	return 0;
+}
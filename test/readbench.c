@@ -0,0 +1,121 @@
+/* reades throughput on a generated file of records and comments: from
+ * the file, which is mmaped, and through a pipe into the read(2)
+ * window. fgetc over the same bytes is what the reader paid a byte
+ * before it had a window.
+ * usage: test/readbench [MB] */
+#define AUX_IMPL
+#define BENCH
+#include "aux.h"
+#include "types/arena.h"
+#include "types/sexp.h"
+#include "sym.h"
+#include "read.h"
+#include "test/test.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+
+static const char *WORD[] = {
+	"record", "name", "value", "id", "tags", "nil", "alpha", "beta",
+	"gamma", "delta", "epsilon", "zeta", "x", "y", "z", "-",
+};
+
+static size_t
+generate(const char *path, size_t size)
+{
+	FILE *f = fopen(path, "w");
+	size_t n = 0;
+	if (!f) exits("fopen %s:", path);
+	while (n < size) {
+		int len = 0;
+		switch (randn(4)) {
+		case 0:		/* a comment block */
+			for (int i = 1 + randn(6); i--;)
+				len += fprintf(f, ";; %s %s, %d of the %s\n", WORD[randn(nelem(WORD))],
+					       WORD[randn(nelem(WORD))], (int)randn(1000), WORD[randn(nelem(WORD))]);
+			break;
+		case 1:		/* a long string literal */
+			len += fprintf(f, "(%s \"", WORD[randn(nelem(WORD))]);
+			for (int i = 8 + randn(64); i--;)
+				len += fprintf(f, "%s%s ", WORD[randn(nelem(WORD))], randn(8) ? "" : "\\\"");
+			len += fprintf(f, "\")\n");
+			break;
+		default:	/* a record */
+			len += fprintf(f, "(%s %d (", WORD[randn(nelem(WORD))], (int)randn(100000));
+			for (int i = randn(8); i--;)
+				len += fprintf(f, "%s ", WORD[randn(nelem(WORD))]);
+			len += fprintf(f, ") \"%s\" %d)\n", WORD[randn(nelem(WORD))], -(int)randn(100));
+		}
+		n += len;
+	}
+	fclose(f);
+	return n;
+}
+
+/* every form of `input', nil for stdin */
+static size_t
+readall(const char *input)
+{
+	Reader *reader = ropen(input);
+	size_t forms = 0;
+	if (!reader) exits("ropen %s:", input);
+	for (;;) {
+		Sexp *sexp = reades(reader);
+		const char *err = readerr(reader);
+		sexpfree(sexp);
+		if (err) break;
+		forms++;
+	}
+	if (!readeof(reader)) exits("%s: %s at %zu", input, readerr(reader), readerrat(reader));
+	rclose(reader);
+	return forms;
+}
+
+static void
+report(const char *what, size_t bytes, double t)
+{
+	printf("read: %-6s %8.1f MB %7.3f s %8.1f MB/s\n", what, bytes / 1e6, t, bytes / 1e6 / t);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[] = "/tmp/readbenchXXXXXX";
+	size_t size = (argc > 1 ? strtoul(argv[1], nil, 10) : 100) << 20;
+	int fd = mkstemp(path), pipefd[2];
+	size_t bytes, forms;
+	volatile size_t lists = 0;
+	double t;
+	if (fd < 0) exits("mkstemp:");
+	close(fd);
+	bytes = generate(path, size);
+
+	t = now();
+	forms = readall(path);
+	report("mmap", bytes, now() - t);
+
+	FILE *f = fopen(path, "r");
+	t = now();
+	for (int c; (c = fgetc(f)) != EOF;) lists += c == '(';
+	report("fgetc", bytes, now() - t);
+	fclose(f);
+
+	if (pipe(pipefd) < 0) exits("pipe:");
+	if (!fork()) {		/* cat the file into the pipe */
+		char buf[1 << 16];
+		ssize_t len;
+		close(pipefd[0]);
+		fd = open(path, O_RDONLY);
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			if (write(pipefd[1], buf, len) != len) _exit(1);
+		_exit(0);
+	}
+	close(pipefd[1]);
+	dup2(pipefd[0], STDIN_FILENO);
+	close(pipefd[0]);
+	t = now();
+	if (readall(nil) != forms) exits("pipe: not the forms of the file");
+	report("pipe", bytes, now() - t);
+	wait(nil);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,73 @@
+/* the SSE2 and AVX2 scanners against the scalar ones */
+#define AUX_IMPL
+#include "aux.h"
+#include "scan.h"
+#include "test/test.h"
+
+#define BUF 160		/* a few vectors of either width with a tail */
+
+typedef struct {
+	Scan space, sym, line, str;
+} Scanners;
+
+static const char *LEVEL[] = {"scalar", "sse2", "avx2"};
+
+/* the bytes the classes are made of, and some that are in none */
+static const char ALPHA[] = " \t\n\v\f\r()`'.#\"\\;[]ab9-\x01\x7f\x80\xff";
+
+static Scanners
+scanners(void)
+{
+	return (Scanners){scanspace, scansym, scanline, scanstr};
+}
+
+static void
+same(Scanners *ref, Scanners *vec, const char *p, const char *end)
+{
+	CHECK(ref->space(p, end) == vec->space(p, end));
+	CHECK(ref->sym(p, end) == vec->sym(p, end));
+	CHECK(ref->line(p, end) == vec->line(p, end));
+	CHECK(ref->str(p, end) == vec->str(p, end));
+}
+
+static void
+compare(Scanners *ref, Scanners *vec)
+{
+	char buf[BUF];
+	/* every byte at every place in a vector, on a background that
+	 * keeps each scanner going */
+	for (int c = 0; c < 256; c++) {
+		for (size_t at = 0; at < 2 * 32 + 1; at++) {
+			memset(buf, ' ', BUF);
+			buf[at] = c;
+			CHECK(ref->space(buf, buf + BUF) == vec->space(buf, buf + BUF));
+			memset(buf, 'a', BUF);
+			buf[at] = c;
+			same(ref, vec, buf, buf + BUF);
+		}
+	}
+	/* runs of class bytes, from any start to any end */
+	for (int i = 0; i < 20000; i++) {
+		size_t run = 1 + randn(BUF / 2);
+		for (size_t j = 0; j < BUF; j++)
+			buf[j] = randn(run) ? buf[j ? j - 1 : 0] : ALPHA[randn(sizeof(ALPHA) - 1)];
+		size_t beg = randn(BUF), end = beg + randn(BUF - beg + 1);
+		same(ref, vec, buf + beg, buf + end);
+	}
+}
+
+int
+main(void)
+{
+	scaninit(SCAN_SCALAR);
+	Scanners ref = scanners();
+	for (ScanLevel l = SCAN_SSE2; l <= SCAN_AVX2; l++) {
+		if (scaninit(l) != l) {
+			printf("scan: no %s here, skipped\n", LEVEL[l]);
+			continue;
+		}
+		Scanners vec = scanners();
+		compare(&ref, &vec);
+	}
+	return DONE("scan");
+}
@@ -0,0 +1,62 @@
+/* the scanners of each level on runs of their class bytes as long as
+ * tokens, comment lines and long strings get, in GB/s of bytes scanned
+ * usage: test/scanbench [MB] */
+#define AUX_IMPL
+#define BENCH
+#include "aux.h"
+#include "scan.h"
+#include "test/test.h"
+
+static const char *LEVEL[] = {"scalar", "sse2", "avx2"};
+static const size_t RUN[] = {8, 64, 4096};
+
+typedef struct {
+	const char *name;
+	char fill, stop;	/* what the run is made of, where it ends */
+} Class;
+
+static const Class CLASS[] = {
+	{"space", ' ', 'a'},
+	{"sym", 'a', ' '},
+	{"line", 'a', '\n'},
+	{"str", 'a', '"'},
+};
+
+static Scan
+scanner(size_t class)
+{
+	Scan scan[] = {scanspace, scansym, scanline, scanstr};
+	return scan[class];
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t size = (argc > 1 ? strtoul(argv[1], nil, 10) : 64) << 20;
+	char *buf = malloc(size);
+	printf("scan: %-6s %-6s", "", "");
+	for (size_t r = 0; r < nelem(RUN); r++) printf(" %6zu B runs", RUN[r]);
+	printf("\n");
+	for (size_t c = 0; c < nelem(CLASS); c++) {
+		memset(buf, CLASS[c].fill, size);
+		for (ScanLevel l = SCAN_SCALAR; l <= SCAN_AVX2; l++) {
+			if (scaninit(l) != l) continue;
+			Scan scan = scanner(c);
+			printf("scan: %-6s %-6s", CLASS[c].name, LEVEL[l]);
+			for (size_t r = 0; r < nelem(RUN); r++) {
+				size_t run = RUN[r], stops = 0;
+				for (size_t i = run; i < size; i += run + 1) buf[i] = CLASS[c].stop;
+				double t = now();
+				for (const char *p = buf, *end = buf + size; p < end; p++, stops++)
+					p = scan(p, end);
+				t = now() - t;
+				if (stops != size / (run + 1) + 1) exits("%s: %zu stops", CLASS[c].name, stops);
+				printf(" %8.2f GB/s", size / 1e9 / t);
+				for (size_t i = run; i < size; i += run + 1) buf[i] = CLASS[c].fill;
+			}
+			printf("\n");
+		}
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,207 @@
+/* `rnext' against `reades' on the same inputs: the same forms, then the
+ * same error at the same place */
+#define AUX_IMPL
+#include "aux.h"
+#include "types/arena.h"
+#include "types/sexp.h"
+#include "sym.h"
+#include "read.h"
+#include "test/test.h"
+
+#define DEPTH 64
+
+/* `reades' doesn't read [ ] ' ` and # yet, it hands their tokens back
+ * as cells, so the inputs leave them out */
+
+/* a form as text, enough to compare what both readers read */
+typedef struct Node {
+	char *atom;		/* nil for a cons */
+	struct Node *car, *cdr;
+} Node;
+
+static const char *CASES[] = {
+	"", " ", "a", "(a b)", "(a . b)", "(a . (b c))", "(a . ())", "()",
+	"(", ")", "(a", "(a (b)", "a)", ")a", "(a))", "((a) b",
+	"(. a)", "(a .)", "(a . b c)", "(a . . b)", ". a", "(a . b", "(a .",
+	"\"s\"", "\"s", "(\"s", "(a \"s)", "\"a\\\"b\" c", "(a . \"s",
+	"12 -3 +4 x1 1x", "99999999999999999999", "; c\n(a) ; d", "(a ; c\n b)",
+	"(a)(b)c(d)", "((((((((a))))))))",
+};
+
+/* tokens for the random inputs, some of them errors */
+static const char *TOKEN[] = {
+	"(", "(", ")", ")", ".", "a", "bc", "12", "\"s\"", "\"t u\"",
+	" ", " ", "\n", "; c\n", "\"",
+};
+
+/* a list `rnext' is in */
+typedef struct {
+	Node *hd, *tl;
+	int dot;
+} List;
+
+static Arena *arena;
+
+static Node *
+node(char *atom, Node *car, Node *cdr)
+{
+	Node *n = anew(arena, sizeof(Node), "node");
+	*n = (Node){atom, car, cdr};
+	return n;
+}
+
+static Node *
+atom(Cell *cell)
+{
+	char buf[64], *text;
+	int len;
+	switch (cell->type) {
+	case A_INT: len = snprintf(buf, sizeof(buf), "%d", cell->integer); break;
+	case A_SYM: len = snprintf(buf, sizeof(buf), "%s", cell->sym->name); break;
+	case A_STR: len = snprintf(buf, sizeof(buf), "\"%.*s\"", (int)cell->slen, cell->string); break;
+	default:    len = snprintf(buf, sizeof(buf), "?%d", cell->type); break;
+	}
+	text = anew(arena, len + 1, "text");
+	memcpy(text, buf, len + 1);
+	return node(text, nil, nil);
+}
+
+static Node *
+fromcell(Cell *cell)
+{
+	if (!cell) return nil;
+	if (ATOMP(cell)) return atom(cell);
+	return node(nil, fromcell(CAR(cell)), fromcell(CDR(cell)));
+}
+
+static void
+show(Node *n, FILE *out)
+{
+	if (!n) {
+		fputs("()", out);
+		return;
+	}
+	if (n->atom) {
+		fputs(n->atom, out);
+		return;
+	}
+	fputc('(', out);
+	for (;;) {
+		show(n->car, out);
+		if (!(n = n->cdr)) break;
+		if (n->atom) {
+			fputs(" . ", out);
+			show(n, out);
+			break;
+		}
+		fputc(' ', out);
+	}
+	fputc(')', out);
+}
+
+static char *
+viareades(const char *path)
+{
+	char *text;
+	size_t len;
+	FILE *out = open_memstream(&text, &len);
+	Reader *reader = ropen(path);
+	for (;;) {
+		Sexp *sexp = reades(reader);
+		if (!readerr(reader)) {
+			show(fromcell(sexp->cell), out);
+			fputc('\n', out);
+		}
+		sexpfree(sexp);
+		if (readerr(reader)) break;
+	}
+	fprintf(out, "%s at %zu\n", readerr(reader), readerrat(reader));
+	rclose(reader);
+	fclose(out);
+	return text;
+}
+
+static char *
+viarnext(const char *path)
+{
+	List open[DEPTH];
+	int depth = 0;
+	char *text;
+	size_t len;
+	FILE *out = open_memstream(&text, &len);
+	Reader *reader = ropen(path);
+	REvent ev;
+	Node *n;
+	while (rnext(reader, &ev) < EV_END) {
+		switch (ev.type) {
+		case EV_OPEN:
+			assert(depth < DEPTH);
+			open[depth++] = (List){nil, nil, 0};
+			continue;
+		case EV_DOT:
+			open[depth - 1].dot = 1;
+			continue;
+		case EV_ATOM:
+			n = atom(ev.cell);
+			break;
+		case EV_CLOSE:
+			n = open[--depth].hd;
+			break;
+		default:
+			continue;
+		}
+		if (!depth) {		/* a whole form */
+			show(n, out);
+			fputc('\n', out);
+		} else if (open[depth - 1].dot) {
+			open[depth - 1].tl->cdr = n;
+		} else {
+			Node *cell = node(nil, n, nil);
+			if (open[depth - 1].tl) open[depth - 1].tl->cdr = cell;
+			else open[depth - 1].hd = cell;
+			open[depth - 1].tl = cell;
+		}
+	}
+	fprintf(out, "%s at %zu\n", readerr(reader), readerrat(reader));
+	rclose(reader);
+	fclose(out);
+	return text;
+}
+
+static void
+compare(const char *path, const char *input)
+{
+	FILE *f = fopen(path, "w");
+	fputs(input, f);
+	fclose(f);
+	areset(arena);
+	char *want = viareades(path), *got = viarnext(path);
+	CHECK(!strcmp(want, got));
+	if (strcmp(want, got))
+		fprintf(stderr, "input: %s\nreades:\n%srnext:\n%s", input, want, got);
+	free(want);
+	free(got);
+}
+
+int
+main(void)
+{
+	char path[] = "/tmp/streamXXXXXX", input[256];
+	int fd = mkstemp(path);
+	if (fd < 0) exits("mkstemp:");
+	close(fd);
+	arena = aini();
+	for (size_t i = 0; i < nelem(CASES); i++) compare(path, CASES[i]);
+	for (int i = 0; i < 3000; i++) {
+		input[0] = '\0';
+		for (size_t n = 1 + randn(16); n--;) {
+			const char *tok = TOKEN[randn(nelem(TOKEN))];
+			strcat(input, tok);
+			if (randn(2)) strcat(input, " ");
+		}
+		compare(path, input);
+	}
+	unlink(path);
+	deinit(arena);
+	return DONE("stream");
+}
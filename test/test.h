@@ -0,0 +1,45 @@
+/* shared by the checks and benchmarks in test/, see `make test' and
+ * `make bench', a benchmark defines BENCH and has no CHECK */
+/*
+#include "aux.h"
+*/
+
+#ifndef BENCH
+static long checks, fails;
+
+/* reports a failed `cond' and goes on */
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		fails++;						\
+	}								\
+} while (0)
+
+/* the exit status of main */
+#define DONE(name) (printf("%s: %ld of %ld checks failed\n", name, fails, checks), fails != 0)
+#endif
+
+/* xorshift, the checks and the inputs are the same on every run */
+static uint64_t rng = 88172645463325252ULL;
+
+static inline uint64_t
+rand64(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+/* in [0, n) */
+#define randn(n) (rand64() % (n))
+
+/* seconds, for the benchmarks */
+static inline double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,44 @@
+/* types/vec.h on the heap, inline and in an arena */
+#define AUX_IMPL
+#include "aux.h"
+#include "types/arena.h"
+#include "types/vec.h"
+#include "test/test.h"
+
+#define N 10000
+
+static void
+vecheck(void)
+{
+	VEC(long, heap);
+	VEC_SBO(long, sbo, 8);
+	Arena *a = aini();
+	Vec(long) av;
+	vec_arena(av, a);
+	for (long i = 0; i < N; i++) {
+		vec_push(heap, i);
+		vec_push(sbo, i);
+		vec_push(av, i);
+		CHECK(vec_cap(heap) >= vec_len(heap));
+		CHECK(vec_cap(sbo) >= vec_len(sbo));
+		CHECK(vec_cap(av) >= vec_len(av));
+	}
+	CHECK(vec_len(heap) == N && vec_len(sbo) == N && vec_len(av) == N);
+	for (long i = 0; i < N; i++) CHECK(heap[i] == i && sbo[i] == i && av[i] == i);
+	for (long i = N - 1; i >= N / 2; i--) CHECK(vec_pop(heap) == i);
+	vec_shrink(heap);
+	CHECK(vec_cap(heap) == N / 2);
+	vec_reserve(heap, 2 * N);
+	CHECK(vec_cap(heap) == 2 * N && heap[N / 2 - 1] == N / 2 - 1);
+	vec_free(heap);
+	vec_free(sbo);
+	vec_free(av);
+	deinit(a);
+}
+
+int
+main(void)
+{
+	vecheck();
+	return DONE("vec");
+}
@@ -0,0 +1,76 @@
+/* short lived vectors the size of a token's, made, filled with a few
+ * elements and dropped, on the heap, inline (VEC_SBO with room for 8) and
+ * in an arena released after each, in ns per vector.  Past 8 elements the
+ * inline vector spills to the heap.
+ * usage: test/vecbench [vectors] */
+#define AUX_IMPL
+#define BENCH
+#include "aux.h"
+#include "types/arena.h"
+#include "types/vec.h"
+#include "test/test.h"
+
+static volatile long sink;
+
+static double
+heap(size_t n, long len)
+{
+	long sum = 0;
+	double t0 = now();
+	for (size_t i = 0; i < n; i++) {
+		VEC(long, v);
+		for (long j = 0; j < len; j++) vec_push(v, j);
+		sum += vec_end(v);
+		vec_free(v);
+	}
+	sink = sum;
+	return now() - t0;
+}
+
+static double
+sbo(size_t n, long len)
+{
+	long sum = 0;
+	double t0 = now();
+	for (size_t i = 0; i < n; i++) {
+		VEC_SBO(long, v, 8);
+		for (long j = 0; j < len; j++) vec_push(v, j);
+		sum += vec_end(v);
+		vec_free(v);
+	}
+	sink = sum;
+	return now() - t0;
+}
+
+static double
+arena(size_t n, long len)
+{
+	Arena *a = aini();
+	long sum = 0;
+	double t0 = now();
+	for (size_t i = 0; i < n; i++) {
+		Amark mark = amark(a);
+		Vec(long) v;
+		vec_arena(v, a);
+		for (long j = 0; j < len; j++) vec_push(v, j);
+		sum += vec_end(v);
+		arelease(a, mark);
+	}
+	sink = sum;
+	double t = now() - t0;
+	deinit(a);
+	return t;
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n = argc > 1 ? strtoul(argv[1], nil, 10) : 10000000;
+	long lens[] = { 1, 4, 8, 16, 64 };
+	for (size_t i = 0; i < nelem(lens); i++) {
+		double th = heap(n, lens[i]), ts = sbo(n, lens[i]), ta = arena(n, lens[i]);
+		printf("vec: %2ld elements %6.1f heap %6.1f inline %6.1f arena ns/vector\n",
+		       lens[i], th * 1e9 / n, ts * 1e9 / n, ta * 1e9 / n);
+	}
+	return 0;
+}
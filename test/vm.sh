@@ -0,0 +1,36 @@
+#!/bin/sh
+# Every way of running a program must print what the plain stack VM
+# prints: peephole levels, the register VM, the JIT checked against
+# run(), hash-consed reading and one pool for all forms. If there is a
+# file.out next to file.l that's what they all must print.
+# usage: test/vm.sh prog file.l ...
+
+prog=$1
+shift
+fails=0
+
+# the results and errors, not the listings around them
+results() {
+	"$prog" "$@" 2>&1 | grep -E '^;; STACK TOP|^; The |^[0-9]+: |MISMATCH'
+}
+
+for f in "$@"; do
+	want=$(results -O0 "$f")
+	if [ -f "${f%.l}.out" ] && [ "$want" != "$(cat "${f%.l}.out")" ]; then
+		echo "$f: -O0 differs from ${f%.l}.out" >&2
+		fails=$((fails + 1))
+	fi
+	for opts in -O1 -O2 -r "-j 0 -d" "-j 1 -d" -H -s; do
+		# shellcheck disable=SC2086
+		got=$(results $opts "$f")
+		if [ "$got" != "$want" ]; then
+			echo "$f: $opts differs from -O0" >&2
+			printf '%s\n' "$want" > /tmp/vm.want.$$
+			printf '%s\n' "$got" | diff /tmp/vm.want.$$ - >&2
+			rm -f /tmp/vm.want.$$
+			fails=$((fails + 1))
+		fi
+	done
+done
+echo "vm: $fails runs differed"
+[ "$fails" -eq 0 ]
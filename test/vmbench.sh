@@ -0,0 +1,46 @@
+#!/bin/sh
+# The VMs as eval -b measures them, summed over all forms of each file:
+# the stack VM threaded with computed gotos against the same VM built
+# with VM_SWITCH, in ns per instruction, then the stack VM against the
+# register VM, in instructions executed and ns per run of the file, and
+# last the bytecode and the stack VM's time without the peephole pass
+# (-O0) and with all of it (-O2).
+# usage: test/vmbench.sh prog prog-switch file.l ...
+
+threaded=$1
+switch=$2
+shift 2
+runs=${RUNS:-100000}
+
+# ns per instruction of the stack VM
+perstep() {
+	"$1" -b "$runs" "$2" 2>&1 | awk '
+	/^;;; BENCH STACK/ { steps += $4; ns += $6 }
+	END { printf "%6.2f", steps ? ns / steps : 0 }'
+}
+
+for f in "$@"; do
+	echo "vm: $f $(perstep "$threaded" "$f") threaded $(perstep "$switch" "$f") switch ns/step"
+done
+
+for f in "$@"; do
+	"$threaded" -b "$runs" "$f" 2>&1 | awk -v f="$f" '
+	/^;;; BENCH STACK/ { ssteps += $4; sns += $6 }
+	/^;;; BENCH REG .*STEPS/ { rsteps += $4; rns += $6 }
+	END {
+		printf "vm: %s stack %7d steps %9.1f ns  reg %7d steps %9.1f ns\n",
+		       f, ssteps, sns, rsteps, rns
+	}'
+done
+
+# bytes of code and ns of the stack VM at optimization level $1
+code() {
+	"$threaded" -O"$1" -b "$runs" "$2" 2>&1 | awk '
+	/^;;; BENCH CODE/ { bytes += $6 }
+	/^;;; BENCH STACK/ { ns += $6 }
+	END { printf "%6d bytes %9.1f ns", bytes, ns }'
+}
+
+for f in "$@"; do
+	echo "vm: $f -O0 $(code 0 "$f")  -O2 $(code 2 "$f")"
+done
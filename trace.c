@@ -0,0 +1,101 @@
+#include <stdatomic.h>
+#include "aux.h"
+#include "sym.h"
+#include "types/value.h"
+#include "types/arena.h"
+#include "types/sexp.h"
+#include "types/vec.h"
+#include "types/ht.h"
+#include "compi.h"
+#include "trace.h"
+
+/* the file is in host byte order, it's read back on the same machine */
+#define PUT(trace, x) fwrite(&(x), sizeof(x), 1, (trace)->out)
+
+static void
+putu8(Trace *trace, uint8_t u) { PUT(trace, u); }
+
+static void
+putu32(Trace *trace, uint32_t u) { PUT(trace, u); }
+
+static void
+putu64(Trace *trace, uint64_t u) { PUT(trace, u); }
+
+Trace *
+traceopen(const char *path)
+{
+	Trace *trace = calloc(1, sizeof(Trace));
+	if (!trace) return nil;
+	if (!(trace->out = fopen(path, "wb"))) {
+		free(trace);
+		return nil;
+	}
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace->out);
+	putu32(trace, TRACE_VERSION);
+	return trace;
+}
+
+void
+traceclose(Trace *trace)
+{
+	if (!trace) return;
+	tracedrain(trace);
+	fclose(trace->out);
+	free(trace);
+}
+
+static void
+putconst(Trace *trace, Value val)
+{
+	const char *text = nil;
+	uint8_t tag;
+	if      (INTP(val))   tag = 'i';
+	else if (DOUBLP(val)) tag = 'd';
+	else if (SYMP(val))   tag = 's', text = AS_SYM(val)->name;
+	else if (STRP(val))   tag = 'S', text = AS_PTR(val);
+	else                  tag = '?';
+	putu64(trace, val.as_uint);
+	putu8(trace, tag);
+	putu32(trace, text ? strlen(text) : 0);
+	if (text) fwrite(text, 1, strlen(text), trace->out);
+}
+
+void
+tracechunk(Trace *trace, Chunk *chunk)
+{
+	tracedrain(trace);	/* events of the previous chunk go first */
+	putu8(trace, TR_CHUNK);
+	putu32(trace, vec_len(chunk->code));
+	for (size_t i = 0; i < vec_len(chunk->code); i++) {
+		Range where = whereis(chunk, i);
+		putu8(trace, chunk->code[i]);
+		putu64(trace, where.at);
+		putu64(trace, where.len);
+	}
+	putu32(trace, vec_len(chunk->pool->vals));
+	for (size_t i = 0; i < vec_len(chunk->pool->vals); i++)
+		putconst(trace, chunk->pool->vals[i]);
+}
+
+void
+tracedrain(Trace *trace)
+{
+	size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+	size_t lost = atomic_exchange_explicit(&trace->lost, 0, memory_order_relaxed);
+	if (head != tail) {
+		putu8(trace, TR_EVENTS);
+		putu32(trace, head - tail);
+		/* at most two runs, split where the ring wraps */
+		size_t from = tail & (TRACE_RING - 1);
+		size_t n = min(head - tail, TRACE_RING - from);
+		fwrite(trace->ev + from, sizeof(TraceEv), n, trace->out);
+		fwrite(trace->ev, sizeof(TraceEv), head - tail - n, trace->out);
+		atomic_store_explicit(&trace->tail, head, memory_order_release);
+	}
+	if (lost) {
+		putu8(trace, TR_LOST);
+		putu64(trace, lost);
+	}
+	fflush(trace->out);
+}
@@ -0,0 +1,61 @@
+/* binary VM event log, see trdump.c for the decoder */
+/*
+#include <stdatomic.h>
+#include "aux.h"
+#include "types/value.h"
+#include "compi.h"
+*/
+
+#define TRACE_MAGIC "GLVT"
+#define TRACE_VERSION 2	/* 2: LEB128 operands */
+#define TRACE_RING (1 << 16)	/* events, power of two */
+
+/* record kinds in the trace file, each followed by its payload */
+enum {
+	TR_CHUNK = 'C',	/* u32 ncode, ncode * (u8 op, u64 at, u64 len),
+			 * u32 ncons, ncons * (u64 raw, u8 tag, u32 n, n * char) */
+	TR_EVENTS = 'E', /* u32 n, n * TraceEv */
+	TR_LOST = 'L',	/* u64 events dropped on a full ring */
+};
+
+/* One executed instruction, as seen right before it runs. */
+typedef struct {
+	uint32_t ip;	/* offset into the chunk code */
+	uint16_t depth;	/* stack depth */
+	uint8_t op;
+	uint8_t pad_;
+	uint64_t tos;	/* raw top of stack, meaningless when depth is 0 */
+} TraceEv;
+
+/* Single producer, single consumer. The VM only ever touches `head'
+ * and the writer only `tail', so neither side takes a lock. A full ring
+ * drops events and counts them instead of blocking the VM. */
+typedef struct {
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	_Atomic size_t lost;
+	TraceEv ev[TRACE_RING];
+	FILE *out;
+} Trace;
+
+Trace *traceopen(const char *path);
+void traceclose(Trace *trace);
+/* write out `chunk' so the decoder can disassemble the events after it */
+void tracechunk(Trace *trace, Chunk *chunk);
+/* move everything the VM has logged so far to the file */
+void tracedrain(Trace *trace);
+
+static inline void
+traceev(Trace *trace, uint32_t ip, uint8_t op, size_t depth, Value tos)
+{
+	size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+	if (head - tail == TRACE_RING) {
+		atomic_fetch_add_explicit(&trace->lost, 1, memory_order_relaxed);
+		return;
+	}
+	trace->ev[head & (TRACE_RING - 1)] = (TraceEv){
+		.ip = ip, .depth = depth, .op = op, .tos = tos.as_uint,
+	};
+	atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
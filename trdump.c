@@ -0,0 +1,153 @@
+/* render an eval -t trace file as the old VM_TRACE text */
+#define AUX_IMPL
+#include <stdatomic.h>
+#include "aux.h"
+#include "sym.h"
+#include "types/value.h"
+#include "types/arena.h"
+#include "types/sexp.h"
+#include "types/vec.h"
+#include "types/ht.h"
+#include "compi.h"
+#include "reg.h"
+#include "decomp.h"
+#include "trace.h"
+
+typedef struct {
+	uint64_t raw;		/* constant as the VM saw it */
+	Value val;		/* same constant rebuilt here */
+} Const;
+
+static FILE *in;
+static Chunk *chunk;
+static Vec(Const) consts;
+
+static void
+usage(void)
+{
+	exits("usage: %s [tracefile]", argv0);
+}
+
+static void
+get(void *p, size_t n)
+{
+	if (fread(p, 1, n, in) != n) exits("truncated trace");
+}
+
+static uint8_t  getu8(void)  { uint8_t u;  get(&u, sizeof(u)); return u; }
+static uint32_t getu32(void) { uint32_t u; get(&u, sizeof(u)); return u; }
+static uint64_t getu64(void) { uint64_t u; get(&u, sizeof(u)); return u; }
+
+static Value
+getconst(uint64_t raw)
+{
+	uint8_t tag = getu8();
+	uint32_t n = getu32();
+	char *text = malloc(n + 1);
+	get(text, n);
+	text[n] = '\0';
+	switch (tag) {
+	case 's': {
+		Value val = TO_SYM(intern(text, n));
+		free(text);
+		return val;
+	}
+	case 'S': return TO_STR(text);	/* lives as long as we do */
+	default:
+		free(text);
+		return (Value){ .as_uint = raw };
+	}
+}
+
+static void
+readchunk(void)
+{
+	if (chunk) chunkfree(chunk);
+	chunk = chunknew(nil);
+	for (uint32_t n = getu32(); n > 0; n--) {
+		uint8_t op = getu8();
+		Range where;
+		where.at = getu64();
+		where.len = getu64();
+		chunkput(chunk, op, where);
+	}
+	vecptr(consts)->len = 0;
+	for (uint32_t n = getu32(); n > 0; n--) {
+		Const c = { .raw = getu64() };
+		c.val = getconst(c.raw);
+		vec_push(chunk->pool->vals, c.val);
+		vec_push(consts, c);
+	}
+}
+
+static const char *
+tosstr(uint64_t raw)
+{
+	static char buff[BUFSIZ];
+	Value val = { .as_uint = raw };
+	for (size_t i = 0; i < vec_len(consts); i++)
+		if (consts[i].raw == raw) return valuestr(consts[i].val);
+	if (NUMP(val)) return valuestr(val);
+	snprintf(buff, BUFSIZ, "#<%#llx>", (unsigned long long)raw);
+	return buff;
+}
+
+/* Only the depth and the top of the stack are logged, the rest of the
+ * stack is elided. */
+static void
+printstack(TraceEv *ev)
+{
+	printf(";;; STACK BEG\n");
+	if (ev->depth > 1) printf(" <%u more> |", ev->depth - 1);
+	if (ev->depth > 0) printf(" %s ", tosstr(ev->tos));
+	printf("\n;;; STACK END\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	TraceEv ev;
+	int cycle = 0;
+	ARGBEGIN {
+	default: usage();
+	} ARGEND
+	if (argc > 1) usage();
+	in = argc ? fopen(argv[0], "rb") : stdin;
+	if (!in) exits("%s:", argv[0]);
+	get(magic, sizeof(magic));
+	if (memcmp(magic, TRACE_MAGIC, sizeof(magic)) || getu32() != TRACE_VERSION)
+		exits("not a trace file");
+	vec_ini(consts);
+	for (int kind; (kind = fgetc(in)) != EOF;) {
+		switch (kind) {
+		case TR_CHUNK:
+			readchunk();
+			cycle = 0;
+			break;
+		case TR_EVENTS:
+			if (!chunk) exits("events before any chunk");
+			for (uint32_t n = getu32(); n > 0; n--) {
+				get(&ev, sizeof(ev));
+				if (ev.ip >= vec_len(chunk->code)) exits("bad ip %u", ev.ip);
+				if (cycle > 0) {
+					printf("\n;; OK\n");
+					printstack(&ev);
+				}
+				printf(";;;; [CYCLE %04i] ;;;;;\n", ++cycle);
+				decompile_op(chunk, ev.ip);
+				printstack(&ev);
+				printf(";; EXECUTING...\n");
+			}
+			break;
+		case TR_LOST:
+			printf(";; %llu EVENTS LOST\n", (unsigned long long)getu64());
+			break;
+		default:
+			exits("bad record %#x", kind);
+		}
+	}
+	if (chunk) chunkfree(chunk);
+	vec_free(consts);
+	return 0;
+}
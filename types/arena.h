@@ -1,53 +1,311 @@
-/* Resizing arena implementation */
+/* Growing bump arena implementation */
 /*
 #include "aux.h"
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdalign.h>
+#include <sys/mman.h>
 */
 
+/* Allocation bumps a pointer in the current block, when it runs out the
+ * next block is taken, blocks grow geometrically. Memory is not zeroed.
+ * `amark'/`arelease' save and restore a point of allocation, `areset'
+ * releases everything but keeps the blocks for reuse.
+ *
+ * Blocks come from malloc, except in an arena made by `aspan'. That one
+ * cuts them from address space it reserves up front, ARENA_SPAN bytes
+ * aligned to their size. Any pointer into it gives its base, so 32 bits
+ * of offset are enough to point within it, see ABASE and AOFF. Only the
+ * blocks in use are backed by memory, but each such arena costs 4 GB of
+ * address space (8 GB while it's being aligned), which RLIMIT_AS may
+ * refuse, and can't grow past 4 GB. Use it only where the offsets are
+ * needed, the reader's cells. */
+#define ARENA_MAX_GROW (1 << 26) /* blocks stop doubling at this size */
+#define ARENA_SPAN     ((uintptr_t)1 << 32)
+
+#define ABASE(p) ((uintptr_t)(p) & ~(ARENA_SPAN - 1))
+#define AOFF(p)  ((uint32_t)(uintptr_t)(p))
+
+/* With ARENA_STATS defined every arena counts what it hands out, see
+ * `astats'. Allocations through `anew' are also counted per call site,
+ * `site' is a string literal naming it. Without it all of this is gone. */
+#ifdef ARENA_STATS
+#define ASITE_MAX 8
+
+typedef struct {
+	const char *site;
+	size_t count;
+	size_t bytes;
+} ASite;
+
+typedef struct {
+	size_t requested;	/* bytes asked for, since `astatclear' */
+	size_t alignwaste;	/* bytes skipped to align, since `astatclear' */
+	size_t used;		/* bytes handed out right now */
+	size_t peak;		/* most `used' ever was */
+	size_t tailwaste;	/* bytes left at the end of filled blocks */
+	size_t reserved;	/* bytes in all blocks */
+	size_t blocks;
+	size_t shared;		/* allocations given back by `ashare' */
+	size_t sharedbytes;	/* ... and their bytes, both since `astatclear' */
+	ASite sites[ASITE_MAX];	/* last one gathers the rest */
+} AStats;
+#endif
+
+typedef struct Block {
+	struct Block *cdr;
+	char *end;
+} Block;			/* data follows the aligned header */
+
+#define BLOCK_DATA(b) ((char *)(b) + align(sizeof(Block)))
+
 typedef struct Arena {
-	char *reg;
-	char *ptr;
-	ptrdiff_t siz;
-	struct Arena *cdr;
+	char *ptr;		/* bump pointer into `cur' */
+	char *end;
+	Block *cur;
+	Block *head;
+	size_t siz;		/* size of the next new block */
+	char *base;		/* the reserved span, nil for malloc'd blocks */
+	char *brk;		/* where the next block is cut from it */
+#ifdef ARENA_STATS
+	AStats stats;
+#endif
 } Arena;
 
-#define aini() ainit(4096)
+typedef struct {
+	Block *blk;
+	char *ptr;
+#ifdef ARENA_STATS
+	size_t used;
+	size_t tailwaste;
+#endif
+} Amark;
+
+/* a block of at least `siz' bytes, from the span in whole pages */
+static inline Block *
+ablock(Arena *a, size_t siz)
+{
+	if (!a->base) {
+		Block *blk = (Block *)malloc(align(sizeof(Block)) + siz);
+		if (!blk) exits("arena: malloc");
+		blk->cdr = NULL;
+		blk->end = BLOCK_DATA(blk) + siz;
+		return blk;
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t len = (align(sizeof(Block)) + siz + page - 1) & ~(page - 1);
+	if (len > (size_t)(a->base + ARENA_SPAN - a->brk))
+		exits("arena: more than %zu bytes", (size_t)ARENA_SPAN);
+	if (mprotect(a->brk, len, PROT_READ | PROT_WRITE) < 0)
+		exits("arena: mprotect");
+	Block *blk = (Block *)a->brk;
+	a->brk += len;
+	blk->cdr = NULL;
+	blk->end = a->brk;
+	return blk;
+}
+
 static inline Arena *
-ainit(size_t siz) {
+ainit_(size_t siz, char *base) {
 	Arena *a = (Arena *)malloc(sizeof(Arena));
-	a->reg = (char *)calloc(siz, 1);
+	a->base = a->brk = base;
+	a->head = a->cur = ablock(a, siz);
+	a->ptr = BLOCK_DATA(a->cur);
+	a->end = a->cur->end;
 	a->siz = siz;
-	a->ptr = a->reg;
-	a->cdr = NULL;
+#ifdef ARENA_STATS
+	memset(&a->stats, 0, sizeof(AStats));
+	a->stats.reserved = a->end - a->ptr;
+	a->stats.blocks = 1;
+#endif
 	return a;
 }
 
+#define aini() ainit(4096)
+static inline Arena *
+ainit(size_t siz) {
+	return ainit_(siz, nil);
+}
+
+/* an arena whose blocks are all in one ARENA_SPAN, for ABASE and AOFF */
+static inline Arena *
+aspan(size_t siz) {
+	/* twice the span to have an aligned one in it, the rest goes back */
+	char *p = mmap(nil, 2 * ARENA_SPAN, PROT_NONE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) exits("arena: mmap");
+	char *base = (char *)ABASE(p + ARENA_SPAN - 1);
+	if (base > p) munmap(p, base - p);
+	munmap(base + ARENA_SPAN, p + ARENA_SPAN - base);
+	return ainit_(siz, base);
+}
+
 static inline void
 deinit(Arena *a)
 {
-	Arena *cdr, *car = a;
-	do {
-		cdr = car->cdr;
-		free(car->reg);
-		free(car);
-		car = cdr;
-	} while (cdr);
+	if (a->base) {
+		munmap(a->base, ARENA_SPAN);
+	} else {
+		Block *cdr, *car = a->head;
+		do {
+			cdr = car->cdr;
+			free(car);
+			car = cdr;
+		} while (cdr);
+	}
+	free(a);
+}
+
+/* move to the next block with at least `siz' bytes */
+static inline void
+anext(Arena *a, ptrdiff_t siz)
+{
+	Block *blk = a->cur->cdr;
+	if (!blk || blk->end - BLOCK_DATA(blk) < siz) {
+		if (a->siz < ARENA_MAX_GROW) a->siz <<= 1;
+		blk = ablock(a, max((size_t)siz, a->siz));
+		blk->cdr = a->cur->cdr; /* smaller blocks are left for later */
+		a->cur->cdr = blk;
+#ifdef ARENA_STATS
+		a->stats.reserved += blk->end - BLOCK_DATA(blk);
+		a->stats.blocks++;
+#endif
+	}
+#ifdef ARENA_STATS
+	a->stats.tailwaste += a->end - a->ptr;
+#endif
+	a->cur = blk;
+	a->ptr = BLOCK_DATA(blk);
+	a->end = blk->end;
+}
+
+/* `siz' bytes aligned to `al', a power of two */
+static inline void *
+newal(Arena *a, ptrdiff_t siz, size_t al) {
+	char *p = (char *)(((uintptr_t)a->ptr + al - 1) & ~(uintptr_t)(al - 1));
+	if (a->end - p < siz) {
+		/* block data is aligned for anything but over-aligned types */
+		size_t over = al > alignof(max_align_t) ? al - 1 : 0;
+		anext(a, siz + over);
+		p = (char *)(((uintptr_t)a->ptr + al - 1) & ~(uintptr_t)(al - 1));
+	}
+#ifdef ARENA_STATS
+	a->stats.requested += siz;
+	a->stats.alignwaste += p - a->ptr;
+	a->stats.used += p - a->ptr + siz;
+	a->stats.peak = max(a->stats.peak, a->stats.used);
+#endif
+	a->ptr = p + siz;
+	return p;
 }
 
 static inline void *
 new(Arena *a, ptrdiff_t siz) {
-	Arena **cdr = &a;
-        siz = align(siz);
-	do {
-		if ((*cdr)->reg + (*cdr)->siz - (*cdr)->ptr >= siz) {
-			(*cdr)->ptr += siz;
-			return (*cdr)->ptr - siz;
-		}
-		cdr = &(*cdr)->cdr;
-	} while (*cdr);
-	*cdr = ainit(max(siz, a->siz));
-	(*cdr)->ptr += siz;
-	return (*cdr)->reg;
+	return newal(a, siz, alignof(max_align_t));
+}
+
+#ifdef ARENA_STATS
+static inline void *
+anew_(Arena *a, ptrdiff_t siz, size_t al, const char *site)
+{
+	ASite *s = a->stats.sites;
+	while (s->site && strcmp(s->site, site) && s < a->stats.sites + ASITE_MAX - 1) s++;
+	if (!s->site) s->site = site;
+	else if (strcmp(s->site, site)) s->site = "other";
+	s->count++;
+	s->bytes += siz;
+	return newal(a, siz, al);
+}
+#define anew(a, siz, site)       anew_(a, siz, alignof(max_align_t), site)
+#define anewal(a, siz, al, site) anew_(a, siz, al, site)
+
+static inline AStats *astats(Arena *a) { return &a->stats; }
+
+static inline void
+astatclear(Arena *a)
+{
+	a->stats.requested = a->stats.alignwaste = 0;
+	a->stats.shared = a->stats.sharedbytes = 0;
+	a->stats.peak = a->stats.used;
+	memset(a->stats.sites, 0, sizeof(a->stats.sites));
+}
+#else
+#define anew(a, siz, site)       new(a, siz)
+#define anewal(a, siz, al, site) newal(a, siz, al)
+#define astats(a)          ((void *)0)
+#define astatclear(a)      ((void)0)
+#endif
+
+/* print the statistics as lisp comments */
+static inline void
+aprintstats(Arena *a, FILE *out)
+{
+#ifdef ARENA_STATS
+	AStats *s = astats(a);
+	fprintf(out, ";;; ARENA requested %zu used %zu peak %zu\n",
+	        s->requested, s->used, s->peak);
+	fprintf(out, ";;; ARENA reserved %zu in %zu blocks, waste align %zu tail %zu\n",
+	        s->reserved, s->blocks, s->alignwaste, s->tailwaste);
+	if (s->shared)
+		fprintf(out, ";;; ARENA shared %zu allocs %zu bytes, dedup ratio %.2f\n",
+		        s->shared, s->sharedbytes,
+		        s->used ? (double)(s->used + s->sharedbytes) / s->used : 0.0);
+	for (ASite *site = s->sites; site < s->sites + ASITE_MAX && site->site; site++)
+		fprintf(out, ";;; ARENA %-8s %8zu allocs %10zu bytes\n",
+		        site->site, site->count, site->bytes);
+#else
+	USED(a);
+	fprintf(out, ";;; ARENA statistics not compiled in (ARENA_STATS)\n");
+#endif
+}
+
+/* allocator for `vec_arena' in types/vec.h */
+static inline void *
+avec_(void *a, ptrdiff_t siz)
+{
+	return anew((Arena *)a, siz, "vec");
+}
+
+static inline Amark
+amark(Arena *a)
+{
+#ifdef ARENA_STATS
+	return (Amark){a->cur, a->ptr, a->stats.used, a->stats.tailwaste};
+#else
+	return (Amark){a->cur, a->ptr};
+#endif
+}
+
+static inline void
+arelease(Arena *a, Amark mark)
+{
+	a->cur = mark.blk;
+	a->ptr = mark.ptr;
+	a->end = mark.blk->end;
+#ifdef ARENA_STATS
+	a->stats.used = mark.used;
+	a->stats.tailwaste = mark.tailwaste;
+#endif
+}
+
+/* `arelease' what was allocated since `mark' because an equal copy was
+ * there already, it counts for the dedup ratio of `aprintstats' */
+static inline void
+ashare(Arena *a, Amark mark)
+{
+#ifdef ARENA_STATS
+	a->stats.shared++;
+	a->stats.sharedbytes += a->stats.used - mark.used;
+#endif
+	arelease(a, mark);
+}
+
+static inline void
+areset(Arena *a)
+{
+#ifdef ARENA_STATS
+	arelease(a, (Amark){a->head, BLOCK_DATA(a->head), 0, 0});
+#else
+	arelease(a, (Amark){a->head, BLOCK_DATA(a->head)});
+#endif
 }
@@ -1,4 +1,4 @@
-/* single probing resizable hash table / FNV-la hash */
+/* open addressing resizable hash table with control bytes / FNV-la hash */
 /* depends:
 #include <stdlib.h>
 */
@@ -15,12 +15,35 @@
  * If you want to understand this code look first into vec.h which uses the same
  * idea for storing the buffer for values and metadata.
  *
+ * Every slot has a control byte: empty, deleted or 7 bits of the key's hash.
+ * Lookups compare 16 control bytes at once (SSE2 when available) and only
+ * touch keys whose control byte matches. Full hashes are kept next to the
+ * keys so resizing never hashes a key again.
+ *
+ * Keys are copied with strdup unless the table borrows them (`ht_borrow'),
+ * then the caller keeps keys alive as long as the table, which suits
+ * interned symbols and arena owned strings.
+ *
+ * A table with `ht_incremental' set doesn't rehash all at once when it grows,
+ * the old arrays stay around and every `ht_set'/`ht_del' moves a bounded
+ * number of their slots over, lookups look into both and move what they
+ * find. This bounds the latency of a single insert on big tables.
+ *
  * To minimalize to number of hash recalculations use the _idx functions with
- * already generated index from `ht_find_idx'
+ * already generated index from `ht_find_idx'. Keys with precomputed hash
+ * (interned symbols) can skip hashing with the _h variants, which also
+ * compare the key pointer before the string.
  */
-#define HT_INI_CAP 16		/* have to be power of 2 */
+#define HT_INI_CAP 16		/* have to be power of 2, at least HT_GROUP */
 #define HT_MIN_LOAD_FAC 0.65f
-#define HT_OVERLOAD(ht) ((ht->len / (float)ht->cap) > HT_MIN_LOAD_FAC)
+#define HT_OVERLOAD(ht) ((ht->len + ht->dead) / (float)ht->cap > HT_MIN_LOAD_FAC)
+
+#define HT_GROUP 16		/* control bytes probed at once */
+#define HT_EMPTY 0x00		/* so control bytes can come zeroed from calloc */
+#define HT_DEAD  0x01		/* tombstone */
+#define HT_FULL  0x80		/* full slots are 0x80-0xff */
+#define HT_H2(hash) ((uint8_t)(HT_FULL | (hash) >> 57))
+#define HT_INCR_STEP 8		/* default slots moved per operation */
 
 #define FNV_OFFSET 14695981039346656037UL
 #define FNV_PRIME 1099511628211UL
@@ -38,11 +61,35 @@ hash_key(const char *key)
     return hash;
 }
 
+/* same hash for key of lenght `len' that doesn't need NUL */
+static inline uint64_t
+hash_keyn(const char *key, size_t len)
+{
+    uint64_t hash = FNV_OFFSET;
+    for (const char* p = key; p < key + len; p++) {
+        hash ^= (uint64_t)(uchar)(*p);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+typedef struct {
+	const char *key;
+	uint64_t hash;
+} HtSlot_;
+
 typedef struct {
 	size_t cap;
 	size_t len;
+	size_t dead;		/* tombstones */
+	int borrow;		/* keys aren't copied nor freed */
+	size_t els;		/* size of value */
+	size_t incr;		/* slots moved per operation, 0 moves all at once */
+	void *old;		/* table being moved from */
+	size_t moved;		/* slots of `old' already moved */
 	void (*del)(void *);	/* set this for eventual free */
-	const char **keys;	/* if keys[idx] != nil -> ht[idx] exists */
+	HtSlot_ *slots;		/* key with its full hash, side by side */
+	uint8_t *ctrl;		/* cap + HT_GROUP, tail mirrors the first group */
 } HT_;
 
 #define Ht(type) type *
@@ -56,73 +103,255 @@ typedef struct {
 static inline void *		/* function because returns the new vector */
 ht_init_(void **data, size_t els, size_t cap) /* for assigment operation in VEC */
 {
+	if (cap < HT_GROUP) cap = HT_GROUP;
 	*data = htdata(malloc(sizeof(HT_) + cap * els));
-	htptr(*data)->keys = calloc(cap, sizeof(char *));
+	htptr(*data)->slots = calloc(cap, sizeof(HtSlot_));
+	htptr(*data)->ctrl = calloc(cap + HT_GROUP, 1);
 	htptr(*data)->cap = cap;
 	htptr(*data)->del = (void*)0;
+	htptr(*data)->borrow = 0;
+	htptr(*data)->els = els;
+	htptr(*data)->incr = 0;
+	htptr(*data)->old = (void*)0;
+	htptr(*data)->moved = 0;
 	htptr(*data)->len = 0;
+	htptr(*data)->dead = 0;
 	return *data;
 }
 
+#define ht_borrow(ht) (htptr(ht)->borrow = 1) /* set before first `ht_set' */
+#define ht_incremental(ht, step) (htptr(ht)->incr = (step))
+#define ht_len(ht) (htptr(ht)->len + (htptr(ht)->old ? htptr(htptr(ht)->old)->len : 0))
+
+/* bitmasks of a group of control bytes, bit i is for byte i */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define ht_group_(ctrl) _mm_loadu_si128((const __m128i *)(ctrl))
+static inline uint
+ht_match_(const uint8_t *ctrl, uint8_t h2)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ht_group_(ctrl), _mm_set1_epi8(h2)));
+}
+static inline uint
+ht_match_empty_(const uint8_t *ctrl)
+{
+	return ht_match_(ctrl, HT_EMPTY);
+}
+static inline uint		/* empty or deleted */
+ht_match_free_(const uint8_t *ctrl)
+{
+	return ~_mm_movemask_epi8(ht_group_(ctrl)) & 0xffff;
+}
+#else
+static inline uint
+ht_match_(const uint8_t *ctrl, uint8_t h2)
+{
+	uint mask = 0;
+	for (int i = 0; i < HT_GROUP; i++) mask |= (uint)(ctrl[i] == h2) << i;
+	return mask;
+}
+static inline uint
+ht_match_empty_(const uint8_t *ctrl)
+{
+	return ht_match_(ctrl, HT_EMPTY);
+}
+static inline uint
+ht_match_free_(const uint8_t *ctrl)
+{
+	uint mask = 0;
+	for (int i = 0; i < HT_GROUP; i++) mask |= (uint)(ctrl[i] < HT_FULL) << i;
+	return mask;
+}
+#endif
+
+static inline void
+ht_setctrl_(HT_ *ht, size_t idx, uint8_t ctrl)
+{
+	ht->ctrl[idx] = ctrl;
+	if (idx < HT_GROUP) ht->ctrl[ht->cap + idx] = ctrl;
+}
+
 /* gettable (element exists) predicate */
-#define ht_getp(ht, key) (htptr(ht)->keys[ht_find_idx(ht, key)] != (void*)0)
-#define ht_idxp(ht, idx) (htptr(ht)->keys[idx] != (void*)0)
+#define ht_getp(ht, key) ht_idxp(ht, ht_find_idx(ht, key))
+#define ht_idxp(ht, idx) (htptr(ht)->ctrl[idx] >= HT_FULL)
 #define ht_get(ht, key)  (ht[ht_find_idx(ht, key)])
+#define ht_get_h(ht, key, hash) (ht[ht_find_idx_h(ht, key, hash)])
+#define ht_find_idx(data, key) ht_find_idx_h(data, key, hash_key(key))
+/* index of the key, or of the slot it would be inserted to */
 static inline size_t
-ht_find_idx(void *data, const char *key)
+ht_probe_idx_(void *data, const char *key, uint64_t hash)
 {
-	uint64_t hash = hash_key(key);
-	size_t idx = (size_t)(hash & (uint64_t)(htptr(data)->cap - 1)); /* fast modulo */
-	while (htptr(data)->keys[idx]) {
-		if (!strcmp(key, htptr(data)->keys[idx])) return idx;
-		if (++idx >= htptr(data)->cap) idx = 0;
+	HT_ *ht = htptr(data);
+	size_t mask = ht->cap - 1;
+	size_t pos = hash & mask;  /* fast modulo */
+	size_t slot = SIZE_MAX;
+	uint8_t h2 = HT_H2(hash);
+	for (size_t step = HT_GROUP;; pos = (pos + step) & mask, step += HT_GROUP) {
+		const uint8_t *group = ht->ctrl + pos;
+		for (uint m = ht_match_(group, h2); m; m &= m - 1) {
+			size_t idx = (pos + __builtin_ctz(m)) & mask;
+			if (ht->slots[idx].hash != hash) continue;
+			if (key == ht->slots[idx].key || !strcmp(key, ht->slots[idx].key))
+				return idx;
+		}
+		uint avail = ht_match_free_(group);
+		if (slot == SIZE_MAX && avail)
+			slot = (pos + __builtin_ctz(avail)) & mask;
+		if (ht_match_empty_(group)) return slot;
 	}
-	return idx;
 }
 
-#define ht_del(ht, key)     ht_del_idx(ht, ht_find_idx(ht, key))
+/* first free slot for `hash', the key must not be in the table */
+static inline size_t
+ht_free_idx_(HT_ *ht, uint64_t hash)
+{
+	size_t mask = ht->cap - 1;
+	size_t pos = hash & mask;
+	uint avail;
+	for (size_t step = HT_GROUP; !(avail = ht_match_free_(ht->ctrl + pos)); step += HT_GROUP)
+		pos = (pos + step) & mask;
+	return (pos + __builtin_ctz(avail)) & mask;
+}
+
+static inline void ht_unfill_idx_(HT_ *ht, size_t idx);
+
+/* move slot `idx' of `old' to `data', returns the new index */
+static inline size_t
+ht_move_(void *data, void *old, size_t idx)
+{
+	HT_ *ht = htptr(data);
+	uint64_t hash = htptr(old)->slots[idx].hash;
+	size_t dest = ht_free_idx_(ht, hash);
+	if (ht->ctrl[dest] == HT_DEAD) ht->dead--;
+	ht_setctrl_(ht, dest, HT_H2(hash));
+	ht->slots[dest] = htptr(old)->slots[idx];
+	memcpy((char*)data + dest * ht->els, (char*)old + idx * ht->els, ht->els);
+	ht->len++;
+	ht_unfill_idx_(htptr(old), idx);
+	htptr(old)->len--;
+	return dest;
+}
+
+static inline void
+ht_release_(void *data)
+{
+	free(htptr(data)->slots);
+	free(htptr(data)->ctrl);
+	free(htptr(data));
+}
+
+/* move up to `n' slots from the old table */
+static inline void
+ht_migrate_(void *data, size_t n)
+{
+	HT_ *ht = htptr(data);
+	if (!ht->old) return;
+	for (; n && ht->moved < htptr(ht->old)->cap; n--, ht->moved++)
+		if (ht_idxp(ht->old, ht->moved)) ht_move_(data, ht->old, ht->moved);
+	if (ht->moved < htptr(ht->old)->cap) return;
+	ht_release_(ht->old);
+	ht->old = (void*)0;
+}
+
+static inline size_t
+ht_find_idx_h(void *data, const char *key, uint64_t hash)
+{
+	size_t idx = ht_probe_idx_(data, key, hash);
+	void *old = htptr(data)->old;
+	if (!old || ht_idxp(data, idx)) return idx;
+	size_t oidx = ht_probe_idx_(old, key, hash);
+	if (!ht_idxp(old, oidx)) return idx;
+	return ht_move_(data, old, oidx);
+}
+
+/* A deleted slot can become empty again if no probe could ever have seen
+ * a full group around it, otherwise it's a tombstone keeping chains going */
+static inline void
+ht_unfill_idx_(HT_ *ht, size_t idx)
+{
+	uint after = ht_match_empty_(ht->ctrl + idx);
+	uint before = ht_match_empty_(ht->ctrl + ((idx - HT_GROUP) & (ht->cap - 1)));
+	if (after && before &&
+	    __builtin_ctz(after) + __builtin_clz(before << (32 - HT_GROUP)) < HT_GROUP) {
+		ht_setctrl_(ht, idx, HT_EMPTY);
+		return;
+	}
+	ht_setctrl_(ht, idx, HT_DEAD);
+	ht->dead++;
+}
+
+#define ht_step(ht) ht_migrate_(ht, htptr(ht)->incr)
+#define ht_del(ht, key)     (ht_step(ht), ht_del_idx(ht, ht_find_idx(ht, key)))
+#define ht_del_h(ht, key, hash) (ht_step(ht), ht_del_idx(ht, ht_find_idx_h(ht, key, hash)))
 #define ht_del_idx(ht, idx) ht_del_idx_(ht, sizeof(*ht), idx)
 static inline void *
 ht_del_idx_(void *data, size_t els, size_t idx)
 {
-	if (!htptr(data)->keys[idx]) return (void*)0;
-	free((char*)htptr(data)->keys[idx]);
-	htptr(data)->keys[idx] = (void*)0; /* unmark key -> delete */
+	if (!ht_idxp(data, idx)) return (void*)0;
+	if (!htptr(data)->borrow) free((char*)htptr(data)->slots[idx].key);
+	htptr(data)->slots[idx].key = (void*)0;
+	ht_unfill_idx_(htptr(data), idx);
 	void *entry = (uint8_t*)data + els * idx;
 	if (htptr(data)->del) htptr(data)->del(entry);
 	htptr(data)->len--;
 	return entry;
 }
 
+/* mark slot `idx' from `ht_find_idx' as holding `key', the value of
+ * a key that's already there is deleted but the key is kept */
+#define ht_fill_idx(ht, idx, key, hash) ht_fill_idx_(ht, sizeof(*ht), idx, key, hash)
+static inline void
+ht_fill_idx_(void *data, size_t els, size_t idx, const char *key, uint64_t hash)
+{
+	HT_ *ht = htptr(data);
+	if (ht_idxp(data, idx)) {
+		if (ht->del) ht->del((uint8_t*)data + els * idx);
+		return;
+	}
+	if (ht->ctrl[idx] == HT_DEAD) ht->dead--;
+	ht_setctrl_(ht, idx, HT_H2(hash));
+	ht->slots[idx].key = ht->borrow ? key : strdup(key);
+	ht->slots[idx].hash = hash;
+	ht->len++;
+}
+
+
+/* grows the table, or if it's mostly tombstones rehashes it in place */
+static inline void *
+ht_grow_(void *data)
+{
+	HT_ *ht = htptr(data);
+	void *nht;
+	ht_migrate_(data, SIZE_MAX); /* never more than two tables */
+	if (!HT_OVERLOAD(ht)) return data;
+	size_t ncap = ht->cap;
+	if (ht->len >= ht->dead) ncap <<= 1;
+	ht_init_(&nht, ht->els, ncap);
+	htptr(nht)->del = ht->del;
+	htptr(nht)->borrow = ht->borrow;
+	htptr(nht)->incr = ht->incr;
+	htptr(nht)->old = data;
+	if (!ht->incr) ht_migrate_(nht, SIZE_MAX);
+	return nht;
+}
 
 #define ht_ensure(ht) do {						       \
-	if (!HT_OVERLOAD(htptr(ht))) break;			               \
-	void *nht = ht_init_((void **)&nht, sizeof(*ht), htptr(ht)->cap << 1); \
-	for (size_t i = 0; i < htptr(ht)->cap; i++) {		               \
-		if (!htptr(ht)->keys[i]) continue;		               \
-		size_t dest = ht_find_idx(nht, htptr(ht)->keys[i]);            \
-		htptr(nht)->keys[dest] = htptr(ht)->keys[i];		       \
-		memcpy((char*)nht + dest * sizeof(*ht), ht + i, sizeof(*ht));  \
-	}							               \
-	htptr(nht)->len = htptr(ht)->len;				       \
-	free(htptr(ht)->keys);						       \
-	free(htptr(ht));					               \
-	ht = nht;						               \
+	if (HT_OVERLOAD(htptr(ht))) ht = ht_grow_(ht);			       \
 } while (0)
 
 
-#define ht_set(ht, key, val) do {                                              \
-	size_t idx = ht_find_idx(ht, key);		                       \
-	if (!htptr(ht)->keys[idx]) htptr(ht)->len += 2;			       \
-	ht_del_idx(ht, idx);						       \
-	htptr(ht)->keys[idx] = strdup(key);				       \
+#define ht_set(ht, key, val) ht_set_h(ht, key, hash_key(key), val)
+#define ht_set_h(ht, key, hash, val) do {                                      \
+	ht_step(ht);							       \
+	size_t idx = ht_find_idx_h(ht, key, hash);	                       \
+	ht_fill_idx(ht, idx, key, hash);				       \
 	ht[idx] = val;					                       \
 	ht_ensure(ht);							       \
 } while (0)
 
 
 #define ht_free(ht) do {						       \
+	ht_migrate_(ht, SIZE_MAX);					       \
 	for (size_t i = 0; i < htptr(ht)->cap; i++) ht_del_idx(ht, i);         \
-	free(htptr(ht)->keys);						       \
-	free(htptr(ht));						       \
+	ht_release_(ht);						       \
 } while (0)
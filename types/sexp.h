@@ -21,11 +21,14 @@
 #define ATOMP(p)       (p && ((uint64_t)p & CELL_MASK) == A_ATOM)
 #define TO_CONS(p)     ((void*)(CELL_CL_TAG(p) | A_CONS))
 #define TO_ATOM(p)     ((void*)(CELL_CL_TAG(p) | A_ATOM))
-#define CELL_AT(p)     (CELL(p)->loc_.at) /* cell location in file */
-#define CELL_LEN(p)    (CELL(p)->loc_.len) /* cell lenght in file */
-#define CELL_LOC(p)    (CELL(p)->loc_)
-#define CAR(p)         (CELL(p)->car_)
-#define CDR(p)         (CELL(p)->cdr_)
+#define CELL_AT(p)     (CELL(p)->at_) /* cell location in file */
+#define CELL_LEN(p)    (CELL(p)->len_) /* cell lenght in file */
+#define CELL_LOC(p)    ((Range){ CELL_AT(p), CELL_LEN(p) })
+#define CAR(p)         cellptr(p, CELL(p)->car_)
+#define CDR(p)         cellptr(p, CELL(p)->cdr_)
+#define SET_CAR(p, x)  (CELL(p)->car_ = cellref(x))
+#define SET_CDR(p, x)  (CELL(p)->cdr_ = cellref(x))
+#define SET_LOC(p, l)  (CELL_AT(p) = (l).at, CELL_LEN(p) = (l).len)
 
 #define RANGEFMT "<%lu,%lu>"
 #define RANGEP(range) range.at, range.len
@@ -43,36 +46,64 @@ typedef struct {
 	size_t len;
 } Range;
 
+/* Locations are 32 bits, so are car and cdr: the offset of the cell
+ * in the arena of the cons (see ABASE), with CONSP of it in bit 0 and 0
+ * for nil. Both cells have to be in the same arena, made by `aspan', and
+ * files past 4 GB get their locations wrapped. */
 typedef struct Cell {
-	Range loc_;
+	uint32_t at_;
+	uint32_t len_;
 	union {
 		struct {
-			struct Cell *car_; /* don't use these directly */
-			struct Cell *cdr_; /* they have upper bits set to type */
+			uint32_t car_; /* don't use these directly */
+			uint32_t cdr_;
 		};
 		struct {
 			AtomVar type;
+			uint32_t slen; /* string isn't always NUL terminated */
 			union {	/* literals */
 				struct Cell *vec;
-				char *string;
+				const char *string;
+				struct Symbol *sym; /* interned */
 				double doubl;
 				int integer;
 			};
 		};
 	};
-} Cell;				/* 32 bits */
+} Cell;				/* 24 bytes, conses only have the first 16 */
+
+#define CONS_SIZ (offsetof(Cell, cdr_) + sizeof(uint32_t))
 
 typedef struct {
 	const char *fname;
 	Arena *arena;
 	Cell *cell;
+	Range *locs;		/* with R_HASHCONS, see read.h */
+	size_t nlocs;
 } Sexp;
 
+static inline uint32_t
+cellref(Cell *p)
+{
+	return p ? AOFF(CELL(p)) | CONSP(p) : 0;
+}
+
+/* what `ref' in cons `p' points at */
+static inline Cell *
+cellptr(Cell *p, uint32_t ref)
+{
+	if (!ref) return nil;
+	uint64_t q = ABASE(CELL(p)) | (ref & ~(uint32_t)1);
+	return (Cell *)(ref & 1 ? q | A_CONS : q);
+}
+
 static inline Cell *
 cellof(Arena *arena, uint64_t mask, size_t at) {
-	Cell *cell = (Cell *)(CELL_CL_TAG(new(arena, sizeof(Cell))) | mask);
+	Cell *cell = (Cell *)(CELL_CL_TAG(mask == A_CONS
+		? anewal(arena, CONS_SIZ, alignof(Cell), "cons")
+		: anewal(arena, sizeof(Cell), alignof(Cell), "atom")) | mask);
 	CELL_AT(cell) = at;
-	CELL_LEN(cell) = SIZE_MAX;
+	CELL_LEN(cell) = UINT32_MAX;
 	return cell;
 }
 
@@ -80,7 +111,7 @@ static inline Cell *
 cons(Arena *arena, Cell *a, Cell *b, size_t at)
 {
 	Cell *cell = cellof(arena, A_CONS, at);
-	CAR(cell) = a;
-	CDR(cell) = b;
+	SET_CAR(cell, a);
+	SET_CDR(cell, b);
 	return cell;
 }
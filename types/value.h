@@ -1,6 +1,7 @@
 /*
 #include <stdio.h>
 #include <stdlib.h>
+#include "sym.h"
 */
 
 typedef union {
@@ -17,7 +18,7 @@ typedef union {
 #define FALSE_VALUE (BOOL_MASK | 2)     /* 0b*10 */
 
 #define INT_MASK 0x7ffc000000000000 /* use all of mantisa bits for integer */
-#define SYM_MASK 0xfffc000000000000 /* pointers have sign bit set */
+#define SYM_MASK 0xfffc000000000000 /* pointers have sign bit set, to Symbol */
 #define STR_MASK 0xfffe000000000000 /* on x86-64 ptr* is at max 48 bits long */
 #define OBJ_MASK 0xfffd000000000000 /* which is small enought to put in mantysa */
 #define PTR_MASK 0xf000000000000000
@@ -38,6 +39,7 @@ typedef union {
 #define AS_BOOL(v)  ((char)(v.as_uint & 0x1))
 #define AS_INT(v)   ((int32_t)(v.as_uint))
 #define AS_PTR(v)   ((char *)((v).as_uint & 0xFFFFFFFFFFFF))
+#define AS_SYM(v)   ((Symbol *)AS_PTR(v))
 
 /* add tag mask */
 #define CLEAR_TAG(p) ((uint64_t)(p) & ~NANISH_MASK)
@@ -65,7 +67,10 @@ valuestr(Value val)
 	if      (INTP(val))   snprintf(buff, BUFSIZ, "%d",     AS_INT(val));
 	else if (DOUBLP(val)) snprintf(buff, BUFSIZ, "%f",     AS_DOUBL(val));
 	else if (STRP(val))   snprintf(buff, BUFSIZ, "\"%s\"", AS_PTR(val));
-	else if (SYMP(val))   snprintf(buff, BUFSIZ, "%s",     AS_PTR(val));
+	else if (SYMP(val))   snprintf(buff, BUFSIZ, "%s",     AS_SYM(val)->name);
+	else if (val.as_uint == NULL_VALUE) snprintf(buff, BUFSIZ, "nil");
+	else if (BOOLP(val))  snprintf(buff, BUFSIZ, "%s",     AS_BOOL(val) ? "t" : "false");
+	else if (OBJP(val))   snprintf(buff, BUFSIZ, "#<obj %p>", (void *)AS_PTR(val));
 	else assert(0 && "valuestr: invalid type; unreachable");
 	return buff;
 }
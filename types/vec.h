@@ -2,7 +2,7 @@
 #include <stdlib.h>
 */
 
-/* TODO: vec_pop, vec_del and shrink */
+/* TODO: vec_del */
 #define VEC_GROW 1.5
 #define VEC_INI_CAP 16
 
@@ -11,47 +11,105 @@
 typedef struct {
 	size_t cap;
 	size_t len;
+	void *(*alloc)(void *ctx, ptrdiff_t siz); /* nil for malloc */
+	void *ctx;		/* VEC_INLINE_ if the buffer isn't allocated */
 } Vec_;
 
+#define VEC_INLINE_ ((void *)1)
+
 #define Vec(type) type *
 #define VEC(type, name) type *name = vec_ini(name) /* shorthand */
 #define vecptr(data) ((Vec_ *)(data)-1)		   /* internals */
 #define vecdata(vec) ((void *)((Vec_ *)(vec) + 1))
 
+/* Vector with the first `n' elements on the stack, it moves to the heap
+ * when it grows over them. Don't return it from the declaring function.
+ * Only the header is set, an initializer would zero the whole buffer. */
+#define VEC_SBO(type, name, n)						       \
+	struct { Vec_ hdr; type buf[n]; } name##_sbo_;			       \
+	type *name = (name##_sbo_.hdr = (Vec_){(n), 0, NULL, VEC_INLINE_},     \
+	              name##_sbo_.buf)
+
 /* I'm using functions because they can't be used as accesors */
 static inline size_t vec_len(void *data) { return vecptr(data)->len; }
 static inline size_t vec_cap(void *data) { return vecptr(data)->cap; }
-#define vec_siz(data) (sizeof(Vec_) + sizeof(*data) + vecptr(data)->cap)
+#define vec_siz(data) (sizeof(Vec_) + sizeof(*data) * vecptr(data)->cap)
 #define vec_end(data) (data[vec_len(data) - 1])
+#define vec_pop(data) (data[--vecptr(data)->len])
 
 
 #define vec_ini(data) vec_init(data, VEC_INI_CAP)
-#define vec_init(data, siz) vec_init_((void **)&data, sizeof(*data), siz)
+#define vec_init(data, siz) vec_init_((void **)&data, sizeof(*data), siz, NULL, NULL)
+/* vector allocated from Arena (types/arena.h), it's gone with the arena */
+#define vec_arena(data, arena) vec_init_((void **)&data, sizeof(*data), VEC_INI_CAP, avec_, arena)
 static inline void *		/* function because returns the new vector */
-vec_init_(void **data, size_t els, size_t siz) /* for assigment operation in VEC */
+vec_init_(void **data, size_t els, size_t siz, void *(*alloc)(void *, ptrdiff_t), void *ctx)
 {
-	*data = vecdata(malloc(sizeof(Vec_) + els * siz));
-	vecptr(*data)->cap = siz;
-	vecptr(*data)->len = 0;
+	Vec_ *vec = alloc ? alloc(ctx, sizeof(Vec_) + els * siz)
+	                  : malloc(sizeof(Vec_) + els * siz);
+	vec->cap = siz;
+	vec->len = 0;
+	vec->alloc = alloc;
+	vec->ctx = ctx;
+	*data = vecdata(vec);
 	return *data;
 }
 
 
 #define vec_free(data) do {                                                    \
-	free(vecptr(data));					               \
+	if (!vecptr(data)->alloc && !vecptr(data)->ctx) free(vecptr(data));    \
 	data = NULL;                                                           \
 } while (0)
 
+/* move to buffer for `cap' elements, returns the new vector */
+static inline void *
+vec_realloc_(Vec_ *vec, size_t els, size_t cap)
+{
+	Vec_ *new;
+	size_t siz = sizeof(Vec_) + els * cap;
+	if (vec->alloc) {
+		new = vec->alloc(vec->ctx, siz);
+	} else if (!vec->ctx) {
+		return vecdata(realloc(vec, siz));
+	} else {
+		new = malloc(siz); /* spill the inline buffer */
+		vec->ctx = NULL;
+	}
+	memcpy(new, vec, sizeof(Vec_) + els * vec->len);
+	return vecdata(new);
+}
+
+static inline void *
+vec_grow_(Vec_ *vec, size_t els, size_t need)
+{
+	size_t cap = vec->cap * VEC_GROW;
+	vec->cap = max(max(cap, need), (size_t)VEC_INI_CAP);
+	return vec_realloc_(vec, els, vec->cap);
+}
+
 /* At the end the `data' is reasigned with new buffer
  * because of this you shouldn't pass vec directly in function arguments
  * it will override only the Vec pinter inside fun but not the passed parameter
  */
 #define vec_ensure(data, siz) do {                                             \
-	if (vec_len(data) + (siz) > vec_cap(data)) {                           \
-		vecptr(data)->cap = vec_len(data) * VEC_GROW;                  \
-		if (vec_len(data) + (siz) > vec_cap(data))                     \
-			vecptr(data)->cap = vec_len(data) + (siz);             \
-		data = vecdata(realloc(vecptr(data), vec_siz(data)));          \
+	if (vec_len(data) + (siz) > vec_cap(data))                             \
+		data = vec_grow_(vecptr(data), sizeof(*data), vec_len(data) + (siz)); \
+} while (0)
+
+/* room for `siz' elements in total */
+#define vec_reserve(data, siz) do {                                            \
+	if ((siz) > vec_cap(data)) {                                           \
+		vecptr(data)->cap = (siz);                                     \
+		data = vec_realloc_(vecptr(data), sizeof(*data), (siz));       \
+	}                                                                      \
+} while (0)
+
+/* give back the unused capacity, only heap vectors do */
+#define vec_shrink(data) do {                                                  \
+	if (!vecptr(data)->alloc && !vecptr(data)->ctx &&                      \
+	    vec_len(data) < vec_cap(data)) {                                   \
+		vecptr(data)->cap = max(vec_len(data), 1);                     \
+		data = vec_realloc_(vecptr(data), sizeof(*data), vec_cap(data)); \
 	}                                                                      \
 } while (0)
 
@@ -1,7 +1,6 @@
 #include "vm.h"
 
 #define STACK_MAX 4096
-#define VM_TRACE 1
 
 /*;; Glorious Lisp Virtual Machine (GLVM) ;;*/
 typedef enum {